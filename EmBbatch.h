@@ -0,0 +1,172 @@
+/// @file
+/// Parallel decoding of many concatenated packets, for host-side tools.
+// 2026-10-14 http://opensource.org/licenses/mit-license.php
+
+#pragma once
+#ifndef _EMBBATCH_h
+#define _EMBBATCH_h
+
+#include "EmBencode.h"
+#include <thread>
+#include <vector>
+
+/// Batch decoder for a large block of back-to-back packets, such as a log
+/// of received traffic. A quick sequential pass finds where each top-level
+/// value ends, then the packets are parsed on several threads at once, each
+/// into its own token array, and listed in input order. Each packet can then be selected
+/// and walked with the usual EmBdecodeSpan calls, without parsing it again:
+/// @code
+///   EmBbatch<> batch;
+///   batch.decode(data, size);
+///   for (size_t i = 0; i < batch.packetCount(); ++i)
+///     if (batch.select(i) && batch.nextToken() == batch.T_DICT && ...
+/// @endcode
+/// Tokens point into the caller's data, which must stay intact while in use.
+/// @param maxTokens The maximum number of tokens in a single packet.
+template <int maxTokens =256>
+class EmBbatch : public EmBdecodeSpan<maxTokens, uint32_t> {
+	typedef EmBdecodeSpan<maxTokens, uint32_t> Span;
+	typedef typename Span::Token Token;
+
+	/// Per-thread parser, which hands out its tokens after each packet.
+	class Worker : public Span {
+	public:
+		void Collect(std::vector<Token>& out) const
+		{
+			out.insert(out.end(), this->tokens, this->tokens + this->count);
+		};
+	};
+
+public:
+  /// Position of one packet in the decoded data, and of its tokens.
+  struct Packet {
+	  size_t off;            ///< offset of the packet in the decoded data
+	  uint32_t len;          ///< size of the packet in bytes
+	  uint32_t first, count; ///< range of its tokens, count is 0 if too many
+	  uint32_t part;         ///< which of the token arrays holds them
+  };
+
+protected:
+	const char* data;
+	size_t errors;
+	std::vector<Packet> packets;
+	std::vector< std::vector<Token> > parts; // one token array per thread
+
+	/// Parse a contiguous range of packets, on one thread.
+	void Parse(size_t from, size_t to, uint32_t part)
+	{
+		std::vector<Token>& out = parts[part];
+		Worker worker;
+		if (to > from) // guess, to avoid most of the regrowing
+			out.reserve((packets[to-1].off + packets[to-1].len -
+						packets[from].off) / 4);
+		for (size_t i = from; i < to; ++i) {
+			Packet& p = packets[i];
+			p.first = out.size();
+			p.count = 0;
+			p.part = part;
+			if (worker.parse(data + p.off, p.len) == p.len) {
+				worker.Collect(out);
+				p.count = out.size() - p.first;
+			}
+		}
+	};
+
+public:
+  EmBbatch() : data(0), errors(0) {}
+
+  /// Split a block of data into packets and decode them all.
+  /// @param src Pointer to the data, referenced by all tokens.
+  /// @param len Number of bytes available at src.
+  /// @param threads Number of threads to use, 0 for one per processor.
+  /// @return Returns the number of bytes used by complete packets, anything
+  ///         after that is incomplete, and was not decoded. Bad data is
+  ///         skipped, see errorCount().
+  size_t decode(const char* src, size_t len, unsigned threads =0)
+  {
+	  data = src;
+	  errors = 0;
+	  packets.clear();
+	  Span::reset();
+
+	  // sequential pre-pass, this only skips over the data
+	  size_t pos = 0;
+	  while (pos < len) {
+		  char ch = src[pos];
+		  if (ch != 'i' && ch != 'd' && ch != 'l' && (ch < '0' || ch > '9')) {
+			  ++pos; // ignore anything else between packets
+			  continue;
+		  }
+		  bool valid;
+		  size_t n = EmBskim(src + pos, len - pos, &valid);
+		  if (n == 0 && valid)
+			  break; // incomplete, the rest has to wait for more data
+		  if (n == 0 || n > 0xFFFFFFFFUL) {
+			  ++errors; // not valid, or too large for the 32-bit token fields
+			  pos += n > 0 ? n : 1; // resynchronise just after a bad start
+			  continue;
+		  }
+		  Packet p = { pos, (uint32_t) n, 0, 0, 0 };
+		  packets.push_back(p);
+		  pos += n;
+	  }
+
+	  if (threads == 0)
+		  threads = std::thread::hardware_concurrency();
+	  if (threads > packets.size())
+		  threads = packets.size();
+	  if (threads < 1)
+		  threads = 1;
+	  parts.clear(); // also drops the old tokens
+	  parts.resize(threads);
+
+	  // split into ranges with about the same number of bytes per thread
+	  std::vector<size_t> bounds (threads + 1, packets.size());
+	  bounds[0] = 0;
+	  for (size_t i = 0, t = 1; i < packets.size() && t < threads; ++i)
+		  if (packets[i].off >= pos / threads * t)
+			  bounds[t++] = i;
+	  std::vector<std::thread> pool;
+	  for (unsigned t = 1; t < threads; ++t)
+		  pool.push_back(std::thread(&EmBbatch::Parse, this,
+					  bounds[t], bounds[t+1], t));
+	  Parse(bounds[0], bounds[1], 0);
+	  for (size_t t = 0; t < pool.size(); ++t)
+		  pool[t].join();
+	  return pos;
+  };
+
+  /// Number of places where bad data was skipped by the last decode() call.
+  size_t errorCount() const
+  {
+	  return errors;
+  };
+
+  /// Number of packets found by the last decode() call.
+  size_t packetCount() const
+  {
+	  return packets.size();
+  };
+
+  /// Position and size of a packet in the decoded data.
+  const Packet& packet(size_t i) const
+  {
+	  return packets[i];
+  };
+
+  /// Select a packet, so that nextToken(), find(), etc. walk its tokens.
+  /// @param i Index of the packet, must be less than packetCount().
+  /// @return Returns false if the packet had more than maxTokens tokens.
+  bool select(size_t i)
+  {
+	  const Packet& p = packets[i];
+	  this->source = data + p.off;
+	  this->count = p.count;
+	  this->next = this->last = 0;
+	  for (uint32_t k = 0; k < p.count; ++k)
+		  this->tokens[k] = parts[p.part][p.first + k];
+	  return p.count > 0;
+  };
+};
+
+#endif
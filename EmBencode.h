@@ -9,15 +9,692 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(__AVR__)
+#include <avr/pgmspace.h>
+#define EMB_PROGMEM PROGMEM
+#else
+#define EMB_PROGMEM
+#endif
+#if defined(ARDUINO)
+class __FlashStringHelper;
+#endif
 
-/// Encoder class to generate Bencode on the fly (no buffer storage needed).
-template <int bufLen>
-class EmBencode {
+/// Scan digit runs 16 bytes at a time in the bulk decoders, on hosts with
+/// SSE2 or 64-bit ARM NEON. Other targets, including AVR, use a plain loop.
+#ifndef EMB_SIMD
+#if defined(__SSE2__) || (defined(__aarch64__) && defined(__ARM_NEON))
+#define EMB_SIMD 1
+#else
+#define EMB_SIMD 0
+#endif
+#endif
+#if EMB_SIMD && defined(__SSE2__)
+#include <emmintrin.h>
+#elif EMB_SIMD
+#include <arm_neon.h>
+#endif
+
+/// Store the binary value of each number in the decode buffer, so that
+/// EmBdecode::asInt64() does not have to parse it again each time. This
+/// uses 8 extra bytes per number, so it is off by default on AVR.
+#ifndef EMB_NUMBER_VALUES
+#if defined(__AVR__)
+#define EMB_NUMBER_VALUES 0
+#else
+#define EMB_NUMBER_VALUES 1
+#endif
+#endif
+
+/// Store the position of the matching T_POP with each T_DICT and T_LIST in
+/// the decode buffer, so that EmBdecode::skipValue() can jump over nested
+/// data. This uses sizeof (SizeT) extra bytes per dict or list, so it is off
+/// by default on AVR, where skipValue() walks the tokens instead.
+#ifndef EMB_SKIP_INDEX
+#if defined(__AVR__)
+#define EMB_SKIP_INDEX 0
+#else
+#define EMB_SKIP_INDEX 1
+#endif
+#endif
+
+/// Store a hash of each string in the decode buffer while it arrives, so
+/// that EmBdecode::find() and asHash() need no pass over the key bytes.
+/// This uses 4 extra bytes per string, so it is off by default on AVR.
+#ifndef EMB_KEY_HASHES
+#if defined(__AVR__)
+#define EMB_KEY_HASHES 0
+#else
+#define EMB_KEY_HASHES 1
+#endif
+#endif
+
+/// Only strings up to this size are hashed as they arrive, longer ones are
+/// hardly ever keys, and are hashed by asHash() only when asked for, so that
+/// large payloads can still be copied in bulk.
+#ifndef EMB_KEY_HASH_LEN
+#define EMB_KEY_HASH_LEN 32
+#endif
+
+/// Keep usage counters in the encoder buffer and decoder, to find out how
+/// much buffer space is really needed in the field. Off by default, then
+/// the counters take no RAM and no code at all.
+#ifndef EMB_STATS
+#define EMB_STATS 0
+#endif
+#if EMB_STATS
+#define EMB_STAT(x) x
+#else
+#define EMB_STAT(x)
+#endif
+
+#if EMB_STATS
+/// Counters kept in EmMemorySink::stats, and so in all buffered encoders,
+/// if EMB_STATS is set.
+struct EmBencodeStats {
+	uint32_t bytes;     ///< bytes written, including dropped ones
+	uint32_t overflows; ///< messages which did not fit in the buffer
+	uint32_t resets;    ///< reset() calls, i.e. messages started
+	uint32_t peak;      ///< highest buffer fill level seen
+};
+
+/// Counters kept in EmBdecode::stats, if EMB_STATS is set.
+struct EmBdecodeStats {
+	uint32_t bytes;     ///< bytes passed to process()
+	uint32_t packets;   ///< complete packets
+	uint32_t strings, numbers, dicts, lists; ///< tokens stored, per type
+	uint32_t overflows; ///< packets dropped because the buffer was full
+	uint32_t resets;    ///< reset() calls
+	uint32_t peak;      ///< highest buffer fill level seen
+	uint8_t maxLevel;   ///< deepest nesting of dicts and lists seen
+};
+#endif
+
+/// Add one character to a key hash (32-bit FNV-1a).
+constexpr uint32_t EmBhashStep (uint32_t hash, char ch)
+{
+	return (hash ^ (uint8_t) ch) * 16777619UL;
+}
+
+/// Hash a zero-terminated key, usable at compile time as switch label:
+/// @code
+///   switch (decoder.asHash()) {
+///     case EmBhash("rate"): ...
+/// @endcode
+/// @param str The key, hash values can be compared with asHash() results.
+/// @param hash Used internally for the recursion.
+constexpr uint32_t EmBhash (const char* str, uint32_t hash =2166136261UL)
+{
+	return *str == 0 ? hash : EmBhash(str + 1, EmBhashStep(hash, *str));
+}
+
+/// Hash a run of bytes, with the same result as EmBhash() at run time.
+inline uint32_t EmBhashBytes (const char* ptr, size_t len)
+{
+	uint32_t hash = 2166136261UL;
+	while (len-- > 0)
+		hash = EmBhashStep(hash, *ptr++);
+	return hash;
+}
+
+/// Parse a decimal integer, with overflow checking.
+/// @param ptr Pointer to the first character (optionally a '-' sign).
+/// @param end Points just past the last character.
+/// @param pval This variable receives the value, clamped to the 64-bit range.
+/// @return Returns false if the text is not a valid 64-bit signed integer.
+inline bool EmBparseInt64 (const char* ptr, const char* end, int64_t* pval)
+{
+	bool neg = ptr < end && *ptr == '-';
+	ptr += neg;
+	uint64_t limit = ((uint64_t) 1 << 63) - !neg, mag = 0;
+	bool ok = ptr < end;
+	for (; ptr < end; ++ptr) {
+		uint8_t d = *ptr - '0';
+		if (d > 9) {
+			ok = false;
+			break;
+		}
+		if (mag > (limit - d) / 10) {
+			mag = limit; // overflow
+			ok = false;
+			break;
+		}
+		mag = 10 * mag + d;
+	}
+	*pval = neg ? (int64_t) (0 - mag) : (int64_t) mag;
+	return ok;
+}
+
+/// Count the decimal digits at the start of a block of data.
+/// @param ptr Pointer to the first character.
+/// @param len Number of bytes available at ptr.
+/// @return Returns the number of leading '0'..'9' characters.
+inline size_t EmBscanDigits (const char* ptr, size_t len)
+{
+	size_t n = 0;
+	// most runs are short, so only switch to vector compares after a few
+	for (; n < 8; ++n)
+		if (n >= len || (uint8_t) (ptr[n] - '0') > 9)
+			return n;
+#if EMB_SIMD && defined(__SSE2__)
+	// shift '0'..'9' to the bottom of the signed range, then compare once
+	const __m128i bias = _mm_set1_epi8((char) ('0' + 0x80));
+	const __m128i top = _mm_set1_epi8((char) (0x80 + 9));
+	for (; n + 16 <= len; n += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*) (ptr + n));
+		int mask = _mm_movemask_epi8(_mm_cmpgt_epi8(_mm_sub_epi8(v, bias), top));
+		if (mask != 0)
+			return n + __builtin_ctz(mask);
+	}
+#elif EMB_SIMD
+	for (; n + 16 <= len; n += 16) {
+		uint8x16_t v = vld1q_u8((const uint8_t*) (ptr + n));
+		uint8x16_t digit = vcltq_u8(vsubq_u8(v, vdupq_n_u8('0')), vdupq_n_u8(10));
+		if (vminvq_u8(digit) == 0)
+			break; // the scalar loop below finds the exact position
+	}
+#endif
+	while (n < len && (uint8_t) (ptr[n] - '0') <= 9)
+		++n;
+	return n;
+}
+
+/// Find where the packet at the start of a block of data ends, with the same
+/// rules as EmBdecodeSpan::parse(), but without storing any tokens, so that
+/// even packets which would not fit in a token table can be stepped over.
+/// @param src Pointer to the first character, which must start a value.
+/// @param len Number of bytes available at src.
+/// @param pvalid This variable will receive false if the data is not valid,
+///        as opposed to merely incomplete, if present.
+/// @return Returns the number of bytes used, or 0 if incomplete or not valid.
+inline size_t EmBskim (const char* src, size_t len, bool* pvalid =0)
+{
+	size_t pos = 0;
+	long level = 0;
+	bool bad = false;
+	while (pos < len) {
+		char ch = src[pos];
+		if (ch == 'i') {
+			if (++pos < len && src[pos] == '-')
+				++pos;
+			size_t digits = EmBscanDigits(src + pos, len - pos);
+			pos += digits;
+			if (pos >= len)
+				break;
+			if (digits == 0 || src[pos] != 'e') {
+				bad = true;
+				break;
+			}
+			++pos;
+		} else if (ch == 'd' || ch == 'l') {
+			++pos;
+			++level;
+			continue;
+		} else if (ch == 'e') {
+			if (level <= 0) {
+				bad = true; // no dict or list to end
+				break;
+			}
+			++pos;
+			--level;
+		} else if ('0' <= ch && ch <= '9') {
+			size_t n = 0, digits = EmBscanDigits(src + pos, len - pos);
+			if (digits > 10) {
+				bad = true; // more than a 32-bit length can hold
+				break;
+			}
+			for (; digits > 0; --digits)
+				n = 10 * n + (src[pos++] - '0');
+			if (pos >= len)
+				break;
+			if (src[pos] != ':') {
+				bad = true;
+				break;
+			}
+			if (len - ++pos < n)
+				break;
+			pos += n;
+		} else if (level > 0) {
+			bad = true; // not valid inside a dict or list
+			break;
+		} else {
+			++pos; // ignore anything else between packets
+			continue;
+		}
+		// end of an item reached
+		if (level <= 0) {
+			if (pvalid != 0)
+				*pvalid = true;
+			return pos; // not in dict or list, data is complete
+		}
+	}
+	if (pvalid != 0)
+		*pvalid = !bad;
+	return 0;
+}
+
+template <size_t... I> struct EmBindices {};
+template <size_t N, size_t... I>
+struct EmBmakeIndices : EmBmakeIndices<N - 1, N - 1, I...> {};
+template <size_t... I>
+struct EmBmakeIndices<0, I...> { typedef EmBindices<I...> type; };
+
+constexpr uint8_t EmBdigits (size_t n)
+{
+	return n < 10 ? 1 : n < 100 ? 2 : 3;
+}
+
+constexpr size_t EmBpow10 (uint8_t n)
+{
+	return n == 0 ? 1 : 10 * EmBpow10(n - 1);
+}
+
+/// Fully encoded form of a constant string, including its length prefix,
+/// built at compile time. Use EmBlit() or EMB_PUSH_LITERAL() to create one.
+template <size_t N>
+struct EmBliteral {
+	static_assert(N < 1000, "literal too long");
+	char data[N + 4];
+	uint16_t len;
+
+	template <size_t... I>
+	constexpr EmBliteral (const char (&s)[N + 1], EmBindices<I...>)
+		: data { At(s, I)... }, len(EmBdigits(N) + 1 + N) {}
+
+	static constexpr char At (const char (&s)[N + 1], size_t i)
+	{
+		return i < EmBdigits(N) ? '0' + N / EmBpow10(EmBdigits(N) - 1 - i) % 10 :
+			i == EmBdigits(N) ? ':' :
+			i < EmBdigits(N) + 1 + N ? s[i - EmBdigits(N) - 1] : 0;
+	}
+};
+
+/// Encode a string literal at compile time, e.g. EmBlit("rate") is "4:rate".
+template <size_t N>
+constexpr EmBliteral<N - 1> EmBlit (const char (&s)[N])
+{
+	return EmBliteral<N - 1>(s, typename EmBmakeIndices<N + 3>::type());
+}
+
+/// Push a string literal, of which the encoded form is prepared at compile
+/// time, and kept in flash memory on AVR. Emitted with one block copy.
+/// @param enc The encoder to use.
+/// @param str A string literal, e.g. "rate".
+#define EMB_PUSH_LITERAL(enc, str) do { \
+		static constexpr EmBliteral<sizeof str - 1> emb_lit EMB_PROGMEM = \
+			EmBlit(str); \
+		(enc).pushLiteral(emb_lit); \
+	} while (0)
+
+/// Output sink which fills a caller-supplied buffer.
+/// Data which does not fit is dropped, and sets a sticky overflow flag.
+class EmMemorySink {
+public:
+  uint8_t* buffer;
+  size_t limit, fill;
+  bool overflow;
+#if EMB_STATS
+  EmBencodeStats stats = EmBencodeStats();
+#endif
+
+  /// @param buf Pointer to the buffer which will receive the encoded data.
+  /// @param len Size of the buffer.
+  EmMemorySink (void* buf, size_t len)
+    : buffer((uint8_t*) buf), limit(len), fill(0), overflow(false) {}
+
+  /// Append a run of bytes to the buffer, with one capacity check per run.
+  void write (const void* ptr, size_t len) {
+    EMB_STAT(stats.bytes += len);
+    if (reserve(len)) {
+      memcpy(buffer + fill, ptr, len);
+      fill += len;
+      EMB_STAT(if (fill > stats.peak) stats.peak = fill);
+    }
+  }
+
+  /// Check up front whether the next bytes fit, e.g. for an entire frame.
+  /// @param len Number of bytes which are about to be written.
+  /// @return Returns false, and sets the overflow flag, if they don't fit.
+  bool reserve (size_t len) {
+    if (!overflow && len > limit - fill) {
+      overflow = true;
+      EMB_STAT(++stats.overflows);
+    }
+    return !overflow;
+  }
+
+  /// True once any data had to be dropped.
+  bool overflowed () const { return overflow; }
+
+  /// Pointer to the start of the encoded data.
+  const uint8_t* data () const { return buffer; }
+  /// Number of bytes encoded so far.
+  size_t size () const { return fill; }
+};
+
+/// Output sink which only counts, to find the exact encoded size up front:
+/// @code
+///   EmBencodeTo<EmCountSink> dry;
+///   ... same push() calls as for the real encoder ...
+///   size_t bytes = dry.size();
+/// @endcode
+class EmCountSink {
+public:
+  size_t fill = 0;
+
+  /// Count a run of bytes, nothing is stored.
+  void write (const void*, size_t len) {
+    fill += len;
+  }
+
+  /// Number of bytes encoded so far.
+  size_t size () const { return fill; }
+};
+
+/// Output sink for canonical bencode, which also checks that the keys of
+/// each dict are sorted and unique, as required for hashing the result:
+/// @code
+///   EmBencodeTo< EmCanonicalSink<200> > encoder;
+///   ... push() calls ...
+///   if (!encoder.canonical()) ...
+/// @endcode
+/// The structure is followed as the data goes out, with one stack entry per
+/// open dict or list, and each key is compared with the previous one at the
+/// same level, in place. If sortLen > 0, a dict with out-of-order keys is
+/// sorted when it ends, if its contents fit in sortLen bytes and it has at
+/// most maxEntries keys. Rolling back or patching data is not tracked.
+/// The SizeT type is used for positions in the tracking state, it must be
+/// able to hold bufLen, e.g. uint16_t for > 255 bytes.
+template <int bufLen, typename SizeT =uint8_t, int maxDepth =8,
+		int sortLen =0, int maxEntries =16>
+class EmCanonicalSink : public EmMemorySink {
+	static_assert(bufLen <= (SizeT) ~(SizeT) 0, "SizeT too small for bufLen");
+	enum { S_ITEM, S_LEN, S_STR, S_INT };
+	uint8_t storage[bufLen];
+protected:
+	struct Level {
+		SizeT start, prevKey, prevLen; // prevKey is 0 until a key is seen
+		bool dict, wantKey, sorted;
+	};
+	Level levels[maxDepth];
+	uint8_t depth, state;
+	SizeT count, strPos;
+	bool isKey, ok;
+	uint8_t scratch[sortLen > 0 ? sortLen : 1];
+
+	/// Find the end of the well-formed value which starts at pos.
+	SizeT Skip (SizeT pos) const
+	{
+		const uint8_t* buf = buffer;
+		int level = 0;
+		do {
+			uint8_t ch = buf[pos];
+			if (ch == 'd' || ch == 'l') {
+				++pos;
+				++level;
+				continue;
+			}
+			if (ch == 'e') {
+				++pos;
+				--level;
+			} else if (ch == 'i') {
+				while (buf[pos++] != 'e')
+					;
+			} else {
+				SizeT n = 0;
+				while (buf[pos] != ':')
+					n = 10 * n + (buf[pos++] - '0');
+				pos += n + 1;
+			}
+		} while (level > 0);
+		return pos;
+	};
+
+	/// Get the position and size of the key of the entry at pos.
+	SizeT Key (SizeT pos, SizeT* plen) const
+	{
+		SizeT n = 0;
+		while (buffer[pos] != ':')
+			n = 10 * n + (buffer[pos++] - '0');
+		*plen = n;
+		return pos + 1;
+	};
+
+	int Compare (SizeT a, SizeT alen, SizeT b, SizeT blen) const
+	{
+		int cmp = memcmp(buffer + a, buffer + b,
+				alen < blen ? alen : blen);
+		return cmp != 0 ? cmp : alen < blen ? -1 : alen > blen;
+	};
+
+	/// Sort the entries of a dict, its 'd' is at start and its 'e' at end.
+	/// @return Returns false if it is too large, or has duplicate keys.
+	bool Sort (SizeT start, SizeT end)
+	{
+		if (sortLen == 0 || end - start - 1 > sortLen)
+			return false;
+		SizeT entry[maxEntries + 1], keyPos[maxEntries], keyLen[maxEntries];
+		uint8_t order[maxEntries], n = 0;
+		for (SizeT pos = start + 1; pos < end; pos = Skip(Skip(pos))) {
+			if (n >= maxEntries)
+				return false;
+			entry[n] = pos;
+			keyPos[n] = Key(pos, keyLen + n);
+			// insertion sort, there are only a few entries
+			uint8_t i = n;
+			for (; i > 0; --i) {
+				int cmp = Compare(keyPos[order[i-1]], keyLen[order[i-1]],
+						keyPos[n], keyLen[n]);
+				if (cmp == 0)
+					return false; // duplicate key
+				if (cmp < 0)
+					break;
+				order[i] = order[i-1];
+			}
+			order[i] = n++;
+		}
+		entry[n] = end;
+		SizeT used = 0;
+		for (uint8_t i = 0; i < n; ++i) {
+			uint8_t k = order[i];
+			memcpy(scratch + used, buffer + entry[k], entry[k+1] - entry[k]);
+			used += entry[k+1] - entry[k];
+		}
+		memcpy(buffer + start + 1, scratch, used);
+		return true;
+	};
+
+	/// Keep track of each value as it starts, to find the keys of dicts.
+	void Item (bool string)
+	{
+		isKey = false;
+		if (depth > 0 && depth <= maxDepth) {
+			Level& lev = levels[depth-1];
+			if (lev.dict) {
+				isKey = lev.wantKey;
+				if (isKey && !string)
+					ok = false; // keys must be strings
+				lev.wantKey = !lev.wantKey;
+			}
+		}
+	};
+
+	void EndString ()
+	{
+		state = S_ITEM;
+		if (isKey) {
+			Level& lev = levels[depth-1];
+			if (lev.prevKey > 0) // keys are never at the very start
+				if (Compare(lev.prevKey, lev.prevLen, strPos, count) >= 0)
+					lev.sorted = false;
+			lev.prevKey = strPos;
+			lev.prevLen = count;
+		}
+	};
+
+	/// Follow the structure of newly written data.
+	void Scan (SizeT pos, SizeT end)
+	{
+		while (pos < end) {
+			if (state == S_STR) {
+				SizeT n = end - pos < strPos + count - pos ?
+							end - pos : strPos + count - pos;
+				pos += n;
+				if (pos >= strPos + count)
+					EndString();
+				continue;
+			}
+			uint8_t ch = buffer[pos++];
+			switch (state) {
+			case S_ITEM:
+				if (ch == 'd' || ch == 'l') {
+					Item(false);
+					if (depth >= maxDepth)
+						ok = false; // too deep to check
+					else {
+						Level& lev = levels[depth];
+						lev.start = pos - 1;
+						lev.prevKey = lev.prevLen = 0;
+						lev.dict = ch == 'd';
+						lev.wantKey = lev.sorted = true;
+					}
+					++depth;
+				} else if (ch == 'e') {
+					if (depth > 0 && --depth < maxDepth) {
+						Level& lev = levels[depth];
+						if (!lev.sorted && !Sort(lev.start, pos - 1))
+							ok = false;
+					}
+				} else if (ch == 'i') {
+					Item(false);
+					state = S_INT;
+				} else {
+					Item(true);
+					count = ch - '0';
+					state = S_LEN;
+				}
+				break;
+			case S_LEN:
+				if (ch != ':')
+					count = 10 * count + (ch - '0');
+				else {
+					strPos = pos;
+					state = S_STR;
+					if (count == 0)
+						EndString();
+				}
+				break;
+			case S_INT:
+				if (ch == 'e')
+					state = S_ITEM;
+				break;
+			}
+		}
+	};
+
+public:
+	EmCanonicalSink () : EmMemorySink(storage, bufLen) { reset(); }
+	// a copy would still point to the original's buffer
+	EmCanonicalSink (const EmCanonicalSink&) = delete;
+	EmCanonicalSink& operator= (const EmCanonicalSink&) = delete;
+
+  /// Append a run of bytes to the buffer, and follow its structure.
+  void write (const void* ptr, size_t len) {
+    SizeT pos = fill;
+    EmMemorySink::write(ptr, len);
+    if (!overflow)
+      Scan(pos, fill);
+  }
+
+  /// Start a new message, the checks begin anew.
+  void reset () {
+    EMB_STAT(++stats.resets);
+    fill = 0;
+    overflow = false;
+    depth = 0;
+    state = S_ITEM;
+    ok = true;
+  }
+
+  /// True if all dicts so far had their keys in order, or could be sorted.
+  /// Also false if the data was nested more than maxDepth levels deep.
+  bool canonical () const { return ok; }
+};
+
+/// Output sink adapter which passes all data through a hasher on its way
+/// out, so that a digest of the frame is ready when encoding is done:
+/// @code
+///   EmBencodeTo< EmHashSink<EmMemorySink, EmBcrc32> > encoder (buf, sizeof buf);
+///   ... push() calls ...
+///   uint32_t crc = encoder.hasher.value();
+/// @endcode
+/// The Hasher class must provide "void update(const void* ptr, size_t len)",
+/// e.g. EmBcrc32, or a thin wrapper around a SHA-1 implementation.
+template <class Sink, class Hasher>
+class EmHashSink : public Sink {
+public:
+  Hasher hasher;
+
+  EmHashSink () {}
+  template <class A>
+  EmHashSink (A a) : Sink(a) {}
+  template <class A, class B>
+  EmHashSink (A a, B b) : Sink(a, b) {}
+
+  /// Hash a run of bytes, then pass it on to the real sink.
+  void write (const void* ptr, size_t len) {
+    hasher.update(ptr, len);
+    Sink::write(ptr, len);
+  }
+};
+
+/// CRC-32, as used by zlib and Ethernet, with a 16-entry table in flash.
+/// Also usable on its own, e.g. on a span returned by EmBdecodeSpan::asRaw().
+class EmBcrc32 {
 public:
-	uint8_t buffer[bufLen];
-	uint8_t buffIdx = 0;
+  uint32_t crc = 0xFFFFFFFFUL;
+
+  /// Start a new checksum.
+  void reset () { crc = 0xFFFFFFFFUL; }
+
+  /// Add a run of bytes to the checksum, one nibble at a time.
+  void update (const void* ptr, size_t len) {
+    static const uint32_t table [16] EMB_PROGMEM = {
+      0x00000000UL, 0x1DB71064UL, 0x3B6E20C8UL, 0x26D930ACUL,
+      0x76DC4190UL, 0x6B6B51F4UL, 0x4DB26158UL, 0x5005713CUL,
+      0xEDB88320UL, 0xF00F9344UL, 0xD6D6A3E8UL, 0xCB61B38CUL,
+      0x9B64C2B0UL, 0x86D3D2D4UL, 0xA00AE278UL, 0xBDBDF21CUL,
+    };
+    const uint8_t* p = (const uint8_t*) ptr;
+    uint32_t c = crc;
+    while (len-- > 0) {
+      c ^= *p++;
+#if defined(__AVR__)
+      c = (c >> 4) ^ pgm_read_dword(table + (c & 0x0F));
+      c = (c >> 4) ^ pgm_read_dword(table + (c & 0x0F));
+#else
+      c = (c >> 4) ^ table[c & 0x0F];
+      c = (c >> 4) ^ table[c & 0x0F];
+#endif
+    }
+    crc = c;
+  }
+
+  /// The checksum of all data so far.
+  uint32_t value () const { return ~crc; }
+};
 
-	EmBencode () {}
+/// Encoder class to generate Bencode on the fly (no buffer storage needed).
+/// All output is handed to the Sink class, which must provide a member
+/// "void write(const void* ptr, size_t len)", for example to write out
+/// to a serial port directly.
+template <class Sink>
+class EmBencodeTo : public Sink {
+public:
+	EmBencodeTo () {}
+  template <class A>
+  EmBencodeTo (A a) : Sink(a) {}
+  template <class A, class B>
+  EmBencodeTo (A a, B b) : Sink(a, b) {}
   
   /// Push a string out in Bencode format.
   /// @param str The zero-terminated string to send out (without trailing \0).
@@ -28,29 +705,108 @@ public:
   /// Push arbitrary bytes in Bencode format.
   /// @param ptr Pointer to the data to send out.
   /// @param len Number of data bytes to send out.
- void push (const void* ptr, uint8_t len) {
-    PushCount(len);
-    PushChar(':');
+ void push (const void* ptr, size_t len) {
+    PushHeader(len);
     PushData(ptr, len);
   }
 
-  /// Push a signed integer in Bencode format.
-  /// @param val The integer to send (this implementation supports 32 bits).
+  /// Push a string from flash memory (PROGMEM) in Bencode format.
+  /// On other than AVR, flash is mapped into memory and this is push(str).
+  /// @param str The zero-terminated string to send out (without trailing \0).
+ void push_P (const char* str) {
+#if defined(__AVR__)
+    push_P(str, strlen_P(str));
+#else
+    push(str);
+#endif
+  }
+
+  /// Push arbitrary bytes from flash memory (PROGMEM) in Bencode format.
+  /// @param ptr Pointer to the data to send out, in flash memory.
+  /// @param len Number of data bytes to send out.
+ void push_P (const void* ptr, size_t len) {
+#if defined(__AVR__)
+    PushHeader(len);
+    PushData_P(ptr, len);
+#else
+    push(ptr, len);
+#endif
+  }
+
+#if defined(ARDUINO)
+  /// Push a string created with F("...") in Bencode format.
+ void push (const __FlashStringHelper* str) {
+    push_P((const char*) str);
+  }
+#endif
+
+  /// Push a boolean in Bencode format, as "i0e" or "i1e".
+void push (bool val) {
+    PushData(val ? "i1e" : "i0e", 3);
+  }
+
+  // other pointers would silently become a bool, use push(ptr, len) instead
+  template <class T>
+void push (const T*) = delete;
+
+  /// Push a character as a string of length 1. Use int8_t or uint8_t for
+  /// small numbers, the signedness of plain char depends on the platform.
+void push (char ch) {
+    char buf[3] = { '1', ':', ch };
+    PushData(buf, sizeof buf);
+  }
+
+  /// Push a signed integer in Bencode format. There is one overload per
+  /// width, so that small values only need 8- or 16-bit arithmetic on AVR.
+  /// @param val The integer to send, the full range is supported.
+void push (signed char val) {
+    PushSigned<unsigned char>(val);
+  }
+void push (short val) {
+    PushSigned<unsigned short>(val);
+  }
+void push (int val) {
+    PushSigned<unsigned>(val);
+  }
 void push (long val) {
-    PushChar('i');
-    if (val < 0) {
-      PushChar('-');
-      val = -val;
-    }
-    PushCount(val);
-    PushEnd();
+    PushSigned<unsigned long>(val);
+  }
+void push (long long val) {
+    PushSigned<unsigned long long>(val);
+  }
+
+  /// Push an unsigned integer in Bencode format.
+  /// @param val The integer to send, the full range is supported.
+void push (unsigned char val) {
+    PushUnsigned(val);
+  }
+void push (unsigned short val) {
+    PushUnsigned(val);
+  }
+void push (unsigned val) {
+    PushUnsigned(val);
+  }
+void push (unsigned long val) {
+    PushUnsigned(val);
+  }
+void push (unsigned long long val) {
+    PushUnsigned(val);
+  }
+
+  /// Push a string which was encoded at compile time, see EmBlit().
+  /// On AVR, the literal must be in flash memory, see EMB_PUSH_LITERAL().
+  template <size_t N>
+void pushLiteral (const EmBliteral<N>& lit) {
+#if defined(__AVR__)
+    PushData_P(lit.data, pgm_read_word(&lit.len));
+#else
+    PushData(lit.data, lit.len);
+#endif
   }
 
    /// Push a zero interger in Bencode format.
 void pushZero() {
-	PushChar('i');
-	PushChar('0');
-	PushEnd();
+	PushData("i0e", 3);
 }
 
   /// Start a new new list. Must be matched with a call to endList().
@@ -76,127 +832,619 @@ void endDict () {
     PushEnd();
   }
 
-void reset()
-{
-	memset(&buffer, 0, sizeof(buffer));
-	buffIdx = 0;
-}
-
 protected:
-void PushCount (uint32_t num) {
-    char buf[11];
-	ultoa(num, buf, 10);
-    PushData(buf, strlen(buf));
+  // integers and string headers are formatted completely on the stack,
+  // so that each of them reaches the sink as a single run
+
+  template <typename U, typename T>
+void PushSigned (T val) {
+    char buf[sizeof (U) > 4 ? 23 : 13];
+    char* end = buf + sizeof buf;
+    end[-1] = 'e';
+    U mag = val;
+    if (val < 0)
+      mag = (U) (0 - mag); // also correct for the most negative value
+    char* p = FormatCount(mag, end - 1);
+    if (val < 0)
+      *--p = '-';
+    *--p = 'i';
+    PushData(p, end - p);
+  }
+
+  template <typename U>
+void PushUnsigned (U val) {
+    char buf[sizeof val > 4 ? 22 : 12];
+    char* end = buf + sizeof buf;
+    end[-1] = 'e';
+    char* p = FormatCount(val, end - 1);
+    *--p = 'i';
+    PushData(p, end - p);
+  }
+
+void PushHeader (size_t len) {
+    char buf[sizeof len > 4 ? 21 : 11];
+    char* end = buf + sizeof buf;
+    end[-1] = ':';
+    char* p = FormatCount(len, end - 1);
+    PushData(p, end - p);
+  }
+
+  /// Convert a number of any width to decimal, see FormatCount(uint32_t).
+  /// Types of 8 and 16 bits go to the narrower versions, whatever their name.
+  /// Values over 32 bits are split into 9-digit groups, so that only a few
+  /// 64-bit divisions are needed and the rest uses the 32-bit code below.
+  template <typename U>
+static char* FormatCount (U num, char* end) {
+    char* p = end;
+    if (sizeof num > 4)
+      while (num > (U) 0xFFFFFFFFUL) {
+        char* q = FormatCount((uint32_t) (num % 1000000000UL), p);
+        num /= 1000000000UL;
+        p -= 9;
+        while (q > p)
+          *--q = '0';
+      }
+    if (sizeof num == 1)
+      return FormatCount((uint8_t) num, p);
+    if (sizeof num == 2)
+      return FormatCount((uint16_t) num, p);
+    return FormatCount((uint32_t) num, p);
+  }
+
+  /// Convert an 8-bit number to decimal, with subtractions only.
+static char* FormatCount (uint8_t num, char* end) {
+    char* p = end;
+    uint8_t hundreds = 0, tens = 0;
+    for (; num >= 100; num -= 100)
+      ++hundreds;
+    for (; num >= 10; num -= 10)
+      ++tens;
+    *--p = '0' + num;
+    if (hundreds != 0 || tens != 0)
+      *--p = '0' + tens;
+    if (hundreds != 0)
+      *--p = '0' + hundreds;
+    return p;
+  }
+
+  /// Convert a 16-bit number to decimal, see FormatCount(uint32_t).
+static char* FormatCount (uint16_t num, char* end) {
+#if defined(__AVR__)
+    char* p = end;
+    // same as the 32-bit version, but with 16-bit shifts and adds
+    do {
+      uint16_t q = (num >> 1) + (num >> 2);
+      q += q >> 4;
+      q += q >> 8;
+      q >>= 3;
+      uint8_t r = num - ((q << 3) + (q << 1));
+      if (r > 9) {
+        ++q;
+        r -= 10;
+      }
+      *--p = '0' + r;
+      num = q;
+    } while (num != 0);
+    return p;
+#else
+    return FormatCount((uint32_t) num, end);
+#endif
+  }
+
+  /// Convert a number to decimal, working backwards from the end of a buffer.
+  /// @param num The value to convert.
+  /// @param end Points just past the buffer, which must have room for 10 digits.
+  /// @return Returns a pointer to the first digit.
+static char* FormatCount (uint32_t num, char* end) {
+    char* p = end;
+#if defined(__AVR__)
+    // no hardware divide: approximate num / 10 with shifts and adds
+    do {
+      uint32_t q = (num >> 1) + (num >> 2);
+      q += q >> 4;
+      q += q >> 8;
+      q += q >> 16;
+      q >>= 3;
+      uint8_t r = num - ((q << 3) + (q << 1));
+      if (r > 9) {
+        ++q;
+        r -= 10;
+      }
+      *--p = '0' + r;
+      num = q;
+    } while (num != 0);
+#else
+    // emit two digits per division, using a table of all digit pairs
+    static const char pairs[] =
+      "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+      "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+      "8081828384858687888990919293949596979899";
+    while (num >= 100) {
+      const char* d = pairs + 2 * (num % 100);
+      num /= 100;
+      *--p = d[1];
+      *--p = d[0];
+    }
+    if (num >= 10) {
+      const char* d = pairs + 2 * num;
+      *--p = d[1];
+      *--p = d[0];
+    } else
+      *--p = '0' + num;
+#endif
+    return p;
   }
 
 void PushEnd () {
     PushChar('e');
   }
 
-void PushData (const void* ptr, uint8_t len) {
-    for (const char* p = (const char*) ptr; len > 0; ++p, --len)
-      PushChar(*p);
+void PushData (const void* ptr, size_t len) {
+    this->write(ptr, len);
+  }
+
+#if defined(__AVR__)
+void PushData_P (const void* ptr, size_t len) {
+    // copy from flash via a small buffer, so the sink gets whole runs
+    char buf[16];
+    for (const char* p = (const char*) ptr; len > 0; ) {
+      uint8_t n = len < sizeof buf ? len : sizeof buf;
+      memcpy_P(buf, p, n);
+      PushData(buf, n);
+      p += n;
+      len -= n;
+    }
   }
+#endif
 
-  /// This function is not implemented in the library. It must be supplied by
-  /// the caller to implement the actual writing of caharacters.
 void PushChar(char ch)
 {
-	buffer[buffIdx] = ch;
-	buffIdx++;
+	this->write(&ch, 1);
+}
+
+};
+
+/// Encoder class which collects the data in a caller-supplied buffer, and
+/// can drop or patch up data which has already been pushed. All instances
+/// share the same code, whatever their buffer size.
+class EmBencodeBuffer : public EmBencodeTo<EmMemorySink> {
+protected:
+	size_t strStart = 0; // where the open startString() header begins
+	bool strOpen = false;
+
+	/// Width of the header reserved by startString(), digits plus ':'.
+	uint8_t HeaderWidth (size_t start) const
+	{
+		uint8_t w = 2;
+		for (size_t n = limit - start; n >= 10; n /= 10)
+			++w;
+		return w;
+	}
+
+public:
+  /// A saved encoder position, as returned by mark().
+  struct Mark { size_t pos; bool overflow; };
+
+  /// @param buf Pointer to the buffer which will receive the encoded data.
+  /// @param len Size of the buffer.
+  EmBencodeBuffer (void* buf, size_t len) : EmBencodeTo<EmMemorySink>(buf, len) {}
+
+  /// Start a new message, old contents are overwritten as new data arrives.
+void reset()
+{
+	fill = 0;
+	overflow = false;
+	strOpen = false;
+	EMB_STAT(++stats.resets);
+}
+
+  /// Remember the current position, so that any data pushed after this
+  /// can be dropped again with rollback(), e.g. a list entry which turns
+  /// out not to fit. Marks can be nested, and taken at any point.
+Mark mark() const
+{
+	Mark m = { fill, overflow };
+	return m;
+}
+
+  /// Drop all data pushed since a mark(), including an overflow after it.
+  /// @param m A mark taken since the last reset(), in the current message.
+void rollback(const Mark& m)
+{
+	if (m.pos <= fill) {
+		fill = m.pos;
+		overflow = m.overflow;
+	}
+	if (strOpen && strStart >= m.pos)
+		strOpen = false;
 }
 
+  /// Start a string of which the size is not known yet. Its contents are
+  /// then added with appendString(), and endString() fills in the length,
+  /// so that large values need not be encoded twice. Only one such string
+  /// can be open at a time, push() etc. are not allowed until endString().
+void startString()
+{
+	strStart = fill;
+	strOpen = true;
+	uint8_t w = HeaderWidth(strStart);
+	if (reserve(w))
+		fill += w; // filled in when the size is known
+}
+
+  /// Add data to a string opened with startString().
+  /// @param ptr Pointer to the data to add.
+  /// @param len Number of data bytes to add.
+void appendString(const void* ptr, size_t len)
+{
+	write(ptr, len);
+}
+
+  /// Finish the string, by writing its length in front of the data. The
+  /// header space was reserved for the largest size which can still fit,
+  /// the data is moved down if fewer digits are needed, so the result is
+  /// the same as with a single push(ptr, len) call.
+void endString()
+{
+	if (!strOpen)
+		return;
+	strOpen = false;
+	if (overflow)
+		return;
+	size_t body = strStart + HeaderWidth(strStart);
+	size_t len = fill - body;
+	char buf[sizeof len > 4 ? 21 : 11];
+	char* end = buf + sizeof buf;
+	end[-1] = ':';
+	char* p = FormatCount(len, end - 1);
+	size_t n = end - p;
+	memmove(buffer + strStart + n, buffer + body, len);
+	memcpy(buffer + strStart, p, n);
+	fill = strStart + n + len;
+}
+
+  /// Start a new message and clear the entire buffer, for sensitive data.
+void secureWipe()
+{
+	volatile uint8_t* p = buffer;
+	for (size_t i = 0; i < limit; ++i)
+		p[i] = 0; // volatile, so the compiler can't optimise this away
+	reset();
+}
+};
+
+/// Encoder class with a templated internal buffer, see EmBencodeBuffer.
+/// The SizeT parameter is not used, sizes are always size_t. It is only kept
+/// so that existing code such as EmBencode<500, uint16_t> still compiles.
+template <int bufLen, typename SizeT =uint8_t>
+class EmBencode : public EmBencodeBuffer {
+	uint8_t storage[bufLen];
+public:
+	EmBencode () : EmBencodeBuffer(storage, bufLen) {}
+	// a copy would still point to the original's buffer
+	EmBencode (const EmBencode&) = delete;
+	EmBencode& operator= (const EmBencode&) = delete;
 };
 
 /// Decoder enum
-enum { EMB_ANY, EMB_LEN, EMB_INT, EMB_STR };
+enum { EMB_ANY, EMB_LEN, EMB_INT, EMB_STR, EMB_SYNC,
+		EMB_SKIP, EMB_SKIP_LEN, EMB_SKIP_STR, EMB_SKIP_INT };
 enum { T_STRING = 0, T_NUMBER = 251, T_DICT, T_LIST, T_POP, T_END };
-/// Decoder class, templated internal buffer to collect the incoming data.
-template <int bufLen>
-class EmBdecode {
+/// Decoder class, which collects the incoming data in a caller-supplied
+/// buffer. All decoders with the same SizeT share this code, whatever the
+/// buffer size, see EmBdecode for a version with its own buffer.
+/// The SizeT type must be able to hold the buffer size, e.g. uint16_t for
+/// buffers over 255 bytes. With uint8_t the string length is stored in the
+/// token code itself, with wider types it follows a T_STRING code, so that
+/// strings can exceed 250 bytes. The depth, string length, and digit limits
+/// are checked as the data comes in, so that oversized packets are rejected
+/// as early as possible. The rest of a rejected packet is then skipped by
+/// following its framing, so that nothing inside it is taken as a packet.
+template <typename SizeT =uint8_t>
+class EmBdecodeBuffer {
+protected:
+	char level, *buffer;
+	uint8_t state, token, error;
+	uint8_t depthLimit, digitLimit;
+	uint16_t errors;
+	SizeT bufSize, strLimit;
+	SizeT count, next, last;
+	size_t skip; // bytes left of a string in a rejected packet
+#if EMB_SKIP_INDEX
+	SizeT open; // index slot of the innermost open dict or list, 0 if none
+#endif
+#if EMB_KEY_HASHES
+	uint32_t hash; // of the string which is currently being received
+	bool hashing;  // false if it is too long to be hashed on the fly
+#endif
+#if EMB_STATS
+public:
+	EmBdecodeStats stats = EmBdecodeStats();
 protected:
-	char level, buffer[bufLen];
-	uint8_t count, next, last, state;
+#endif
 
 	void AddToBuf(char ch)
 	{
-		if (next >= bufLen)
+		if (next >= bufSize)
 			buffer[0] = T_END; // mark entire buffer as empty
 		else
 			buffer[next++] = ch;
 	};
 
+	void AddBytes(const void* ptr, uint8_t len)
+	{
+		for (uint8_t i = 0; i < len; ++i)
+			AddToBuf(((const char*) ptr)[i]);
+	};
+
+	void EndString()
+	{
+		AddToBuf(0);
+#if EMB_KEY_HASHES
+		AddBytes(&hash, sizeof hash);
+#endif
+	};
+
+	SizeT Fail(uint8_t reason)
+	{
+		error = reason;
+		if (errors < 0xFFFF)
+			++errors;
+		EMB_STAT(if (next > stats.peak) stats.peak = next);
+		next = 0; // drop the partial packet
+		reset();
+		// only a syntax error loses track of where the next packet starts
+		if (reason != E_OVERFLOW)
+			state = EMB_SYNC;
+		EMB_STAT(stats.overflows += reason == E_OVERFLOW);
+		return 0;
+	};
+
+	/// Drop a packet which breaks a limit, and skip the rest of it. While
+	/// skipping, nothing is stored, and next holds the nesting level.
+	SizeT Reject(uint8_t reason, uint8_t skipState, SizeT depth)
+	{
+		Fail(reason);
+		next = depth;
+		state = skipState;
+		return 0;
+	};
+
+	/// A value inside a rejected packet has been skipped.
+	SizeT Skipped()
+	{
+		state = next > 0 ? EMB_SKIP : EMB_ANY;
+		return 0;
+	};
+
+	/// The skipped data is not valid either, so look for the next packet.
+	SizeT Resync()
+	{
+		next = 0;
+		state = EMB_SYNC;
+		return 0;
+	};
+
+	void AddString(SizeT len)
+	{
+		EMB_STAT(++stats.strings);
+		if (sizeof len == 1) {
+			if (len >= T_NUMBER)
+				next = bufSize; // too long to be stored as a token code
+			AddToBuf(T_STRING + len);
+		} else {
+			AddToBuf(T_STRING);
+			AddBytes(&len, sizeof len);
+		}
+	};
+
 public:
   /// Types of tokens, as returned by nextToken().
   enum { T_STRING = 0, T_NUMBER = 251, T_DICT, T_LIST, T_POP, T_END };
+  /// Reasons for dropping a packet, as returned by lastError().
+  enum { E_NONE, E_OVERFLOW, E_BAD_LENGTH, E_BAD_NUMBER, E_BAD_CHAR, E_BAD_END,
+		  E_TOO_DEEP, E_TOO_LONG, E_TOO_MANY_DIGITS };
 
   /// Initialize a decoder instance with the specified buffer space.
   /// @param buf Pointer to the buffer which will be used by the decoder.
-  /// @param len Size of the buffer, must be in the range 50 to 255.
-  EmBdecode()
+  /// @param len Size of the buffer, limited to what SizeT can hold.
+  /// @param maxDepth Maximum nesting of dicts and lists, at most 127.
+  /// @param maxStrLen Maximum string length, 0 means up to the buffer size.
+  /// @param maxDigits Maximum number of digits in a number.
+  EmBdecodeBuffer(void* buf, size_t len, uint8_t maxDepth =20,
+		  size_t maxStrLen =0, uint8_t maxDigits =20)
+	  : buffer((char*) buf), depthLimit(maxDepth < 128 ? maxDepth : 127),
+		digitLimit(maxDigits)
   { 
+	  bufSize = len < (SizeT) ~(SizeT) 0 ? len : (SizeT) ~(SizeT) 0;
+	  strLimit = maxStrLen != 0 && maxStrLen < bufSize ? maxStrLen : bufSize;
+	  next = skip = 0;
 	  reset(); 
+	  clearErrors();
   }
 
   /// Reset the decoder - can be called to prepare for a new round of decoding.
-  uint8_t reset()
+  SizeT reset()
   {
+	  EMB_STAT(++stats.resets);
+	  EMB_STAT(if (next > stats.peak) stats.peak = next);
 	  count = next;
 	  level = next = 0;
 	  state = EMB_ANY;
+	  token = T_END;
+#if EMB_SKIP_INDEX
+	  open = 0;
+#endif
 	  return count;
   }
 
+  /// Reason why the last bad packet was dropped, one of the E_* codes.
+  uint8_t lastError () const
+  {
+	  return error;
+  };
+
+  /// Number of bad packets dropped since the last clearErrors() call.
+  uint16_t errorCount () const
+  {
+	  return errors;
+  };
+
+  /// Reset the error code and error counter.
+  void clearErrors ()
+  {
+	  error = E_NONE;
+	  errors = 0;
+  };
+
   /// Process a single incoming caharacter.
+  /// Bad packets are dropped right away, see lastError() and errorCount().
+  /// If a packet breaks a limit, the rest of it is skipped. After any other
+  /// error, decoding resumes with the next character which can start a packet.
   /// @return Returns a count > 0 when the buffer contains a complete packet.
-  uint8_t process(char ch){
+  SizeT process(char ch){
+	  EMB_STAT(++stats.bytes);
 	  switch (state) {
+	  case EMB_SYNC:
+		  if (ch != 'i' && ch != 'd' && ch != 'l' && (ch < '0' || ch > '9'))
+			  return 0;
+		  state = EMB_ANY;
+		  // fall through
 	  case EMB_ANY:
 		  if (ch < '0' || ch > '9') {
 			  if (ch == 'i') {
 				  AddToBuf(T_NUMBER);
+				  EMB_STAT(++stats.numbers);
+				  count = next; // remember where the digits start
 				  state = EMB_INT;
 			  }
 			  else if (ch == 'd' || ch == 'l') {
+				  if (level >= depthLimit)
+					  return Reject(E_TOO_DEEP, EMB_SKIP, level + 1);
 				  AddToBuf(ch == 'd' ? T_DICT : T_LIST);
+				  EMB_STAT(ch == 'd' ? ++stats.dicts : ++stats.lists);
+#if EMB_SKIP_INDEX
+				  // the slot links to the outer one until the T_POP arrives
+				  SizeT outer = open;
+				  open = next;
+				  AddBytes(&outer, sizeof outer);
+#endif
 				  ++level;
+				  EMB_STAT(if (level > stats.maxLevel) stats.maxLevel = level);
 			  }
 			  else if (ch == 'e') {
+				  if (level <= 0)
+					  return Fail(E_BAD_END);
+#if EMB_SKIP_INDEX
+				  if (open != 0 && open + sizeof open <= bufSize) {
+					  SizeT slot = open;
+					  memcpy(&open, buffer + slot, sizeof open);
+					  memcpy(buffer + slot, &next, sizeof next);
+				  }
+#endif
 				  AddToBuf(T_POP);
 				  --level;
 				  break; // end of dict or list
 			  }
-			  return 0;
+			  else if (level > 0)
+				  return Fail(E_BAD_CHAR);
+			  return 0; // ignore anything else between packets
 		  }
 		  state = EMB_LEN;
 		  count = 0;
 		  // fall through
 	  case EMB_LEN:
 		  if (ch == ':') {
-			  AddToBuf(T_STRING + count);
+			  AddString(count);
+#if EMB_KEY_HASHES
+			  hash = EmBhash("");
+			  hashing = count <= EMB_KEY_HASH_LEN;
+#endif
 			  if (count == 0) {
-				  AddToBuf(0);
+				  EndString();
 				  break; // empty string
 			  }
 			  state = EMB_STR;
 		  }
-		  else
+		  else if (ch < '0' || ch > '9')
+			  return Fail(E_BAD_LENGTH);
+		  else if ((long) count > strLimit / 10 ||
+				  (long) (10 * count) + (ch - '0') > strLimit) {
+			  skip = 10 * (size_t) count + (ch - '0'); // can't overflow yet
+			  return Reject(E_TOO_LONG, EMB_SKIP_LEN, level);
+		  } else
 			  count = 10 * count + (ch - '0');
 		  return 0;
 	  case EMB_STR:
 		  AddToBuf(ch);
+#if EMB_KEY_HASHES
+		  if (hashing)
+			  hash = EmBhashStep(hash, ch);
+#endif
 		  if (--count == 0) {
-			  AddToBuf(0);
+			  EndString();
 			  break; // end of string
 		  }
 		  return 0;
 	  case EMB_INT:
+		  // accept an optional minus sign, then one or more digits
+		  if (next < bufSize && (ch == 'e' ? next == count ||
+					  (next == count + 1 && buffer[count] == '-') :
+					  (ch < '0' || ch > '9') && (ch != '-' || next != count)))
+			  return Fail(E_BAD_NUMBER);
+		  if (next < bufSize && ch != 'e' &&
+				  next - count >= (SizeT) (digitLimit + (buffer[count] == '-')))
+			  return Reject(E_TOO_MANY_DIGITS, EMB_SKIP_INT, level);
 		  if (ch == 'e') {
+#if EMB_NUMBER_VALUES
+			  int64_t val = 0;
+			  if (next < bufSize)
+				  EmBparseInt64(buffer + count, buffer + next, &val);
 			  AddToBuf(0);
+			  AddBytes(&val, sizeof val);
+#else
+			  AddToBuf(0);
+#endif
 			  break; // end of int
 		  }
 		  AddToBuf(ch);
 		  return 0;
+	  case EMB_SKIP:
+		  if (ch == 'd' || ch == 'l') {
+			  if (next == (SizeT) ~(SizeT) 0)
+				  return Resync(); // far too deep to keep track of
+			  ++next;
+		  } else if (ch == 'e') {
+			  --next;
+			  return Skipped();
+		  } else if (ch == 'i')
+			  state = EMB_SKIP_INT;
+		  else if ('0' <= ch && ch <= '9') {
+			  skip = ch - '0';
+			  state = EMB_SKIP_LEN;
+		  } else
+			  return Resync();
+		  return 0;
+	  case EMB_SKIP_LEN:
+		  if (ch == ':') {
+			  if (skip == 0)
+				  return Skipped();
+			  state = EMB_SKIP_STR;
+		  } else if (ch < '0' || ch > '9' || skip > ((size_t) ~(size_t) 0 - 9) / 10)
+			  return Resync();
+		  else
+			  skip = 10 * skip + (ch - '0');
+		  return 0;
+	  case EMB_SKIP_STR:
+		  if (--skip == 0)
+			  return Skipped();
+		  return 0;
+	  case EMB_SKIP_INT:
+		  if (ch == 'e')
+			  return Skipped();
+		  if ((ch < '0' || ch > '9') && ch != '-')
+			  return Resync();
+		  return 0;
 	  }
 	  // end of an item reached
 	  if (level > 0) {
@@ -204,41 +1452,175 @@ public:
 		  return 0;
 	  }
 	  AddToBuf(T_END);
+	  if ((uint8_t) buffer[0] == T_END)
+		  return Fail(E_OVERFLOW); // the packet did not fit in the buffer
+	  EMB_STAT(++stats.packets);
 	  return reset(); // not in dict or list, data is complete
   };
 
+  /// Process a block of incoming characters in one pass.
+  /// Stops right after a packet completes, so the tokens can be extracted
+  /// before feeding in the remainder of the block.
+  /// @param ptr Pointer to the received data.
+  /// @param len Number of bytes available at ptr.
+  /// @param pused This variable will receive the number of bytes consumed.
+  /// @return Returns a count > 0 when the buffer contains a complete packet.
+  SizeT process(const char* ptr, size_t len, size_t* pused =0)
+  {
+	  const char* p = ptr;
+	  const char* end = ptr + len;
+	  SizeT result = 0;
+	  while (p < end && result == 0) {
+		  // copy string payloads in bulk, leave the last byte to process()
+		  if (state == EMB_STR && count > 1) {
+			  SizeT n = count - 1;
+			  if ((size_t) (end - p) < n)
+				  n = end - p;
+			  if (next + n > bufSize) {
+				  buffer[0] = T_END; // mark entire buffer as empty
+				  next = bufSize;
+			  } else {
+				  memcpy(buffer + next, p, n);
+				  next += n;
+			  }
+#if EMB_KEY_HASHES
+			  if (hashing)
+				  for (SizeT i = 0; i < n; ++i)
+					  hash = EmBhashStep(hash, p[i]);
+#endif
+			  EMB_STAT(stats.bytes += n);
+			  count -= n;
+			  p += n;
+			  continue;
+		  }
+		  // step over string payloads of a rejected packet in bulk
+		  if (state == EMB_SKIP_STR && skip > 1) {
+			  size_t n = skip - 1;
+			  if ((size_t) (end - p) < n)
+				  n = end - p;
+			  EMB_STAT(stats.bytes += n);
+			  skip -= n;
+			  p += n;
+			  continue;
+		  }
+		  // copy the digits of numbers in bulk, within the process() limits
+		  if (state == EMB_INT && next > count && next < bufSize) {
+			  size_t n = EmBscanDigits(p, end - p);
+			  size_t room = digitLimit + (buffer[count] == '-') - (next - count);
+			  if (n > room)
+				  n = room;
+			  if (n > (size_t) (bufSize - next))
+				  n = bufSize - next;
+			  memcpy(buffer + next, p, n);
+			  next += n;
+			  p += n;
+			  EMB_STAT(stats.bytes += n);
+			  if (n > 0)
+				  continue;
+		  }
+		  result = process(*p++);
+	  }
+	  if (pused != 0)
+		  *pused = p - ptr;
+	  return result;
+  };
+
   /// Call this after process() is done, to extract each of the data tokens.
   /// @returns Returns one of the T_STRING .. T_END enumeration codes.
   uint8_t nextToken ()
   {
 	  uint8_t ch = buffer[next++];
 	  last = next;
+	  token = ch < T_NUMBER ? (uint8_t) T_STRING : ch;
 	  switch (ch) {
 	  default: // string
-		  next += ch + 1;
+		  if (sizeof (SizeT) == 1)
+			  next += ch + 1;
+		  else {
+			  SizeT len;
+			  memcpy(&len, buffer + next, sizeof len);
+			  last = next += sizeof len;
+			  next += len + 1;
+		  }
+		  next += EMB_KEY_HASHES ? 4 : 0;
 		  return T_STRING;
 	  case T_NUMBER:
 		  while (buffer[next++] != 0)
 			  ;
+		  next += EMB_NUMBER_VALUES ? 8 : 0;
+		  break;
+	  case T_DICT:
+	  case T_LIST:
+		  next += EMB_SKIP_INDEX ? sizeof (SizeT) : 0;
 		  break;
 	  case T_END:
 		  --next; // don't advance past end token
 		  // fall through
-	  case T_DICT:
-	  case T_LIST:
 	  case T_POP:
 		  break;
 	  }
 	  return ch;
   };
 
+  /// Go back to the first token, to walk the decoded data again.
+  void rewind ()
+  {
+	  last = next = 0;
+	  token = T_END;
+  }
+
+  /// Skip over the next value, including all nested data in a dict or list.
+  /// @return Returns the type of the skipped value, or T_POP or T_END if
+  ///         there was no value left to skip (the position is then unchanged).
+  uint8_t skipValue ()
+  {
+	  SizeT pos = next;
+	  uint8_t type = nextToken();
+	  if (type == T_POP || type == T_END)
+		  next = pos;
+	  else if (type == T_DICT || type == T_LIST) {
+#if EMB_SKIP_INDEX
+		  memcpy(&pos, buffer + last, sizeof pos);
+		  next = pos + 1;
+#else
+		  for (int depth = 1; depth > 0; ) {
+			  uint8_t t = nextToken();
+			  if (t == T_END)
+				  break;
+			  depth += (t == T_DICT || t == T_LIST) - (t == T_POP);
+		  }
+#endif
+	  }
+	  return type;
+  };
+
+  /// Position on an entry, after nextToken() returned T_DICT or T_LIST.
+  /// In a dict, keys and values are counted separately, i.e. 2n is the n'th
+  /// key and 2n+1 its value.
+  /// @param n Index of the entry, the next nextToken() call will return it.
+  /// @return Returns false if there is no such entry.
+  bool child (SizeT n)
+  {
+	  if (token != T_DICT && token != T_LIST)
+		  return false;
+	  next = last + (EMB_SKIP_INDEX ? sizeof (SizeT) : 0);
+	  while (n-- > 0)
+		  if (skipValue() == T_POP)
+			  return false;
+	  SizeT pos = next;
+	  uint8_t type = nextToken();
+	  next = pos;
+	  return type != T_POP && type != T_END;
+  };
+
   /// Extract the last token as string (works for T_STRING and T_NUMBER).
   /// @param plen This variable will receive the size, if present.
   /// @return Returns pointer to a zero-terminated string in the decode buffer.
-  const char* asString (uint8_t* plen =0)
+  const char* asString (SizeT* plen =0)
   {
 	  if (plen != 0)
-		  *plen = next - last - 1;
+		  *plen = next - last - 1 - (token == T_NUMBER ?
+			  (EMB_NUMBER_VALUES ? 8 : 0) : (EMB_KEY_HASHES ? 4 : 0));
 	  return buffer + last;
   };
 
@@ -248,6 +1630,975 @@ public:
   {
 	  return atol(buffer + last);
   };
+
+  /// Extract the last token as 64-bit number (also for strings if numeric).
+  /// T_NUMBER tokens are not parsed again, unless pvalid is requested
+  /// or EMB_NUMBER_VALUES is off.
+  /// @param pvalid This variable will receive false on overflow, if present.
+  /// @return Returns the decoded integer, clamped to the 64-bit range.
+  int64_t asInt64 (bool* pvalid =0)
+  {
+	  int64_t val;
+#if EMB_NUMBER_VALUES
+	  if (token == T_NUMBER && pvalid == 0) {
+		  memcpy(&val, buffer + next - sizeof val, sizeof val);
+		  return val;
+	  }
+#endif
+	  const char* p = buffer + last;
+	  bool ok = EmBparseInt64(p, p + strlen(p), &val);
+	  if (pvalid != 0)
+		  *pvalid = ok;
+	  return val;
+  };
+
+  /// Get the hash of the last string token, as computed by EmBhash().
+  uint32_t asHash ()
+  {
+	  SizeT len;
+	  const char* p = asString(&len);
+#if EMB_KEY_HASHES
+	  if (len <= EMB_KEY_HASH_LEN) {
+		  uint32_t h;
+		  memcpy(&h, buffer + next - sizeof h, sizeof h);
+		  return h;
+	  }
+#endif
+	  return EmBhashBytes(p, len);
+  };
+
+  /// Look up a key, after nextToken() returned T_DICT.
+  /// @param key The key to look for.
+  /// @return Returns true if found, the next nextToken() call then returns
+  ///         its value. Otherwise the position is left at the start of the
+  ///         dict, so that another key can be tried.
+  bool find (const char* key)
+  {
+	  if (token != T_DICT)
+		  return false;
+	  SizeT len = strlen(key), start = last;
+	  uint32_t h = EmBhashBytes(key, len);
+	  next = start + (EMB_SKIP_INDEX ? sizeof (SizeT) : 0);
+	  while (nextToken() == T_STRING) {
+		  SizeT n;
+		  const char* p = asString(&n);
+		  if (n == len && asHash() == h && memcmp(p, key, len) == 0)
+			  return true;
+		  if (skipValue() == T_POP)
+			  break;
+	  }
+	  token = T_DICT;
+	  last = start;
+	  next = start + (EMB_SKIP_INDEX ? sizeof (SizeT) : 0);
+	  return false;
+  };
+};
+
+/// Decoder class with a templated internal buffer to collect the incoming
+/// data, and compile-time limits, see EmBdecodeBuffer for all the details.
+/// Instances with different sizes but the same SizeT share all their code.
+template <int bufLen, typename SizeT =uint8_t,
+		int maxDepth =20, int maxStrLen =bufLen, int maxDigits =20>
+class EmBdecode : public EmBdecodeBuffer<SizeT> {
+	static_assert(bufLen <= (SizeT) ~(SizeT) 0, "SizeT too small for bufLen");
+	static_assert(maxStrLen <= bufLen, "maxStrLen can't exceed bufLen");
+	static_assert(0 < maxDepth && maxDepth < 128, "maxDepth out of range");
+	char storage[bufLen];
+public:
+	EmBdecode ()
+		: EmBdecodeBuffer<SizeT>(storage, bufLen, maxDepth, maxStrLen, maxDigits) {}
+	// a copy would still point to the original's buffer
+	EmBdecode (const EmBdecode&) = delete;
+	EmBdecode& operator= (const EmBdecode&) = delete;
+};
+
+/// Decoder class which parses a complete packet in place, without copying.
+/// Only a small record per token is stored, strings are returned as views
+/// into the caller's receive buffer, which must stay intact while in use.
+/// The SizeT type limits the packet size and the number of tokens.
+template <int maxTokens, typename SizeT =uint16_t>
+class EmBdecodeSpan {
+protected:
+	struct Token { uint8_t type; SizeT off, len; };
+	const char* source;
+	Token tokens[maxTokens];
+	SizeT count, next, last;
+	// for T_DICT and T_LIST tokens, len holds the index of the matching T_POP
+
+	bool AddToken(uint8_t type, SizeT off, SizeT len)
+	{
+		if (count >= maxTokens)
+			return false;
+		tokens[count].type = type;
+		tokens[count].off = off;
+		tokens[count].len = len;
+		++count;
+		return true;
+	};
+
+public:
+  /// Types of tokens, as returned by nextToken().
+  enum { T_STRING = 0, T_NUMBER = 251, T_DICT, T_LIST, T_POP, T_END };
+
+  EmBdecodeSpan()
+  {
+	  reset();
+  }
+
+  /// Reset the decoder - forgets all tokens of the last parsed packet.
+  void reset()
+  {
+	  source = 0;
+	  count = next = last = 0;
+  }
+
+  /// Parse one complete packet from a contiguous buffer.
+  /// @param src Pointer to the received data, referenced by all tokens.
+  /// @param avail Number of bytes available at src, only as much as SizeT
+  ///        can hold is used.
+  /// @return Returns the number of bytes used by the packet, or 0 if the
+  ///         data is incomplete, not valid, or does not fit in the token table.
+  SizeT parse(const char* src, size_t avail)
+  {
+	  reset();
+	  source = src;
+	  SizeT len = avail < (SizeT) ~(SizeT) 0 ? avail : (SizeT) ~(SizeT) 0;
+	  SizeT pos = 0, open = 0; // open is 1 + index of innermost dict or list
+	  int level = 0;
+	  while (pos < len) {
+		  char ch = src[pos];
+		  if (ch == 'i') {
+			  // accept an optional minus sign, then one or more digits
+			  SizeT start = ++pos;
+			  if (pos < len && src[pos] == '-')
+				  ++pos;
+			  SizeT first = pos; // numbers are short, so no EmBscanDigits()
+			  while (pos < len && (uint8_t) (src[pos] - '0') <= 9)
+				  ++pos;
+			  if (pos == first || pos >= len || src[pos] != 'e' ||
+					  !AddToken(T_NUMBER, start, pos - start))
+				  break;
+			  ++pos;
+		  } else if (ch == 'd' || ch == 'l') {
+			  // len links to the outer dict or list until the T_POP arrives
+			  if (!AddToken(ch == 'd' ? T_DICT : T_LIST, pos, open))
+				  break;
+			  open = count;
+			  ++pos;
+			  ++level;
+			  continue;
+		  } else if (ch == 'e') {
+			  if (level <= 0)
+				  break; // no dict or list to end
+			  if (open != 0) {
+				  Token& t = tokens[open - 1];
+				  open = t.len;
+				  t.len = count;
+			  }
+			  if (!AddToken(T_POP, pos, 0))
+				  break;
+			  ++pos;
+			  --level;
+		  } else if ('0' <= ch && ch <= '9') {
+			  SizeT n = 0, digits = EmBscanDigits(src + pos, len - pos);
+			  for (; digits > 0; --digits) {
+				  uint8_t d = src[pos++] - '0';
+				  if (d > len || n > (len - d) / 10)
+					  break; // longer than all the data, also keeps n in range
+				  n = 10 * n + d;
+			  }
+			  if (digits > 0 || pos >= len || src[pos] != ':' ||
+					  len - ++pos < n || !AddToken(T_STRING, pos, n))
+				  break;
+			  pos += n;
+		  } else if (level > 0)
+			  break; // not valid inside a dict or list
+		  else {
+			  ++pos; // ignore anything else between packets
+			  continue;
+		  }
+		  // end of an item reached
+		  if (level <= 0)
+			  return pos; // not in dict or list, data is complete
+	  }
+	  count = 0;
+	  return 0;
+  };
+
+  /// Call this after parse() is done, to extract each of the data tokens.
+  /// @returns Returns one of the T_STRING .. T_END enumeration codes.
+  uint8_t nextToken ()
+  {
+	  if (next >= count)
+		  return T_END;
+	  last = next;
+	  return tokens[next++].type;
+  };
+
+  /// Go back to the first token, to walk the parsed data again.
+  void rewind ()
+  {
+	  last = next = 0;
+  }
+
+  /// Skip over the next value, including all nested data in a dict or list.
+  /// @return Returns the type of the skipped value, or T_POP or T_END if
+  ///         there was no value left to skip (the position is then unchanged).
+  uint8_t skipValue ()
+  {
+	  if (next >= count)
+		  return T_END;
+	  uint8_t type = tokens[next].type;
+	  if (type == T_POP)
+		  return type;
+	  last = next;
+	  next = type == T_DICT || type == T_LIST ? tokens[next].len + 1 : next + 1;
+	  return type;
+  };
+
+  /// Position on an entry, after nextToken() returned T_DICT or T_LIST.
+  /// In a dict, keys and values are counted separately, i.e. 2n is the n'th
+  /// key and 2n+1 its value.
+  /// @param n Index of the entry, the next nextToken() call will return it.
+  /// @return Returns false if there is no such entry.
+  bool child (SizeT n)
+  {
+	  if (last >= count || (tokens[last].type != T_DICT &&
+				  tokens[last].type != T_LIST))
+		  return false;
+	  next = last + 1;
+	  while (n-- > 0)
+		  if (skipValue() == T_POP)
+			  return false;
+	  return next < count && tokens[next].type != T_POP;
+  };
+
+  /// Extract the last token as string (works for T_STRING and T_NUMBER).
+  /// @param plen This variable will receive the size, if present.
+  /// @return Returns pointer into the source data, NOT zero-terminated.
+  const char* asString (SizeT* plen =0)
+  {
+	  if (plen != 0)
+		  *plen = tokens[last].len;
+	  return source + tokens[last].off;
+  };
+
+  /// Extract the last token as number (also works for strings if numeric).
+  /// @return Returns the decoded integer, max 32-bit signed in this version.
+  long asNumber ()
+  {
+	  const char* p = source + tokens[last].off;
+	  const char* end = p + tokens[last].len;
+	  bool neg = p < end && *p == '-';
+	  unsigned long val = 0;
+	  for (p += neg; p < end && '0' <= *p && *p <= '9'; ++p)
+		  val = 10 * val + (*p - '0');
+	  return neg ? -(long) val : (long) val;
+  };
+
+  /// Extract the last token as 64-bit number (also for strings if numeric).
+  /// @param pvalid This variable will receive false on overflow, if present.
+  /// @return Returns the decoded integer, clamped to the 64-bit range.
+  int64_t asInt64 (bool* pvalid =0)
+  {
+	  int64_t val;
+	  const char* p = source + tokens[last].off;
+	  bool ok = EmBparseInt64(p, p + tokens[last].len, &val);
+	  if (pvalid != 0)
+		  *pvalid = ok;
+	  return val;
+  };
+
+  /// Get the hash of the last string token, as computed by EmBhash().
+  uint32_t asHash ()
+  {
+	  return EmBhashBytes(source + tokens[last].off, tokens[last].len);
+  };
+
+  /// Get the source bytes of the last value, as they were received, e.g.
+  /// "i42e", "3:abc", or an entire dict after nextToken() returned T_DICT,
+  /// so that a sub-value can be hashed or forwarded without re-encoding.
+  /// String headers are assumed to be canonical, i.e. without leading zeros.
+  /// @param plen This variable will receive the size.
+  /// @return Returns pointer into the source data, or 0 after T_POP / T_END.
+  const char* asRaw (SizeT* plen)
+  {
+	  *plen = 0;
+	  if (last >= count)
+		  return 0;
+	  const Token& t = tokens[last];
+	  SizeT start = t.off, end;
+	  switch (t.type) {
+	  case T_STRING:
+		  start -= 2; // skip back over the ':' and the last digit
+		  for (SizeT n = t.len; n >= 10; n /= 10)
+			  --start;
+		  end = t.off + t.len;
+		  break;
+	  case T_NUMBER:
+		  --start; // the 'i'
+		  end = t.off + t.len + 1;
+		  break;
+	  case T_DICT:
+	  case T_LIST:
+		  end = tokens[t.len].off + 1; // just past the matching 'e'
+		  break;
+	  default:
+		  return 0;
+	  }
+	  *plen = end - start;
+	  return source + start;
+  };
+
+  /// Look up a key, after nextToken() returned T_DICT.
+  /// Keys are compared by length first, so no hashing is needed here.
+  /// @param key The key to look for.
+  /// @return Returns true if found, the next nextToken() call then returns
+  ///         its value. Otherwise the position is left at the start of the
+  ///         dict, so that another key can be tried.
+  bool find (const char* key)
+  {
+	  if (last >= count || tokens[last].type != T_DICT)
+		  return false;
+	  SizeT len = strlen(key), start = last;
+	  next = start + 1;
+	  while (nextToken() == T_STRING) {
+		  const Token& t = tokens[last];
+		  if (t.len == len && memcmp(source + t.off, key, len) == 0)
+			  return true;
+		  if (skipValue() == T_POP)
+			  break;
+	  }
+	  last = start;
+	  next = start + 1;
+	  return false;
+  };
+};
+
+/// Streaming decoder which returns each token as soon as it is complete.
+/// It needs no buffer for the packet, only a few bytes of state: data is
+/// fed in with feed(), then nextToken() is called until it returns T_END.
+/// Strings are returned in one or more chunks, pointing straight into the
+/// fed data, as much as was available at the time. A bad string length or
+/// number, or a stray 'e', stops decoding with a T_ERROR token, until reset()
+/// is called.
+class EmBdecodeStream {
+protected:
+	const char *ptr, *end, *chunk;
+	uint32_t count, chunkLen;
+	char level, digits[21];
+	uint8_t state, ndigits, token, error;
+	bool partial;
+
+	uint8_t Fail(uint8_t reason)
+	{
+		error = reason;
+		return token = T_ERROR;
+	};
+
+public:
+  /// Types of tokens, as returned by nextToken(), T_ERROR is only used here.
+  enum { T_STRING = 0, T_ERROR = 250, T_NUMBER = 251, T_DICT, T_LIST, T_POP,
+		  T_END };
+  /// Reasons for stopping, as returned by lastError(), same as EmBdecode.
+  enum { E_NONE, E_BAD_LENGTH = 2, E_BAD_NUMBER = 3, E_BAD_END = 5,
+		  E_TOO_MANY_DIGITS = 8 };
+
+  EmBdecodeStream()
+  {
+	  reset();
+  }
+
+  /// Reset the decoder, to start over at the beginning of a new packet.
+  void reset()
+  {
+	  ptr = end = chunk = 0;
+	  count = chunkLen = 0;
+	  level = 0;
+	  state = EMB_ANY;
+	  ndigits = 0;
+	  token = T_END;
+	  error = E_NONE;
+	  partial = false;
+  }
+
+  /// Reason why decoding stopped with T_ERROR, one of the E_* codes.
+  uint8_t lastError () const
+  {
+	  return error;
+  };
+
+  /// Supply the next run of incoming data, must stay valid until nextToken()
+  /// returns T_END, or as long as string chunks from it are being used.
+  /// @param data Pointer to the received data.
+  /// @param len Number of bytes available at data.
+  void feed(const char* data, size_t len)
+  {
+	  ptr = data;
+	  end = data + len;
+  }
+
+  /// Process incoming data until the next token is complete.
+  /// @return Returns one of the T_STRING .. T_POP enumeration codes, T_END
+  ///         when all data has been consumed and feed() must be called again,
+  ///         or T_ERROR for bad data (again on each call, until reset()).
+  uint8_t nextToken ()
+  {
+	  if (error != E_NONE)
+		  return T_ERROR;
+	  while (ptr < end) {
+		  char ch = *ptr;
+		  switch (state) {
+		  case EMB_ANY:
+			  ++ptr;
+			  if ('0' <= ch && ch <= '9') {
+				  state = EMB_LEN;
+				  count = ch - '0';
+			  } else if (ch == 'i') {
+				  state = EMB_INT;
+				  ndigits = 0;
+			  } else if (ch == 'd' || ch == 'l') {
+				  ++level;
+				  return token = ch == 'd' ? T_DICT : T_LIST;
+			  } else if (ch == 'e') {
+				  if (level <= 0)
+					  return Fail(E_BAD_END);
+				  --level;
+				  return token = T_POP;
+			  }
+			  break; // anything else is ignored between items
+		  case EMB_LEN:
+			  ++ptr;
+			  if (ch != ':') {
+				  if (ch < '0' || ch > '9' || count > (0xFFFFFFFFUL - 9) / 10)
+					  return Fail(E_BAD_LENGTH);
+				  count = 10 * count + (ch - '0');
+				  break;
+			  }
+			  state = EMB_STR;
+			  if (count > 0)
+				  break;
+			  // fall through - to return an empty string
+		  case EMB_STR:
+			  chunk = ptr;
+			  chunkLen = count;
+			  if ((size_t) (end - ptr) < chunkLen)
+				  chunkLen = end - ptr;
+			  ptr += chunkLen;
+			  count -= chunkLen;
+			  partial = count > 0;
+			  if (!partial)
+				  state = EMB_ANY;
+			  return token = T_STRING;
+		  case EMB_INT:
+			  // accept an optional minus sign, then one or more digits
+			  ++ptr;
+			  if (ch == 'e') {
+				  if (ndigits == 0 || (ndigits == 1 && digits[0] == '-'))
+					  return Fail(E_BAD_NUMBER);
+				  digits[ndigits] = 0;
+				  state = EMB_ANY;
+				  return token = T_NUMBER;
+			  }
+			  if ((ch < '0' || ch > '9') && (ch != '-' || ndigits != 0))
+				  return Fail(E_BAD_NUMBER);
+			  if (ndigits >= sizeof digits - 1)
+				  return Fail(E_TOO_MANY_DIGITS);
+			  digits[ndigits++] = ch;
+			  break;
+		  }
+	  }
+	  return T_END;
+  };
+
+  /// Nesting level, a top-level item is complete when this returns zero
+  /// after a token.
+  int depth () const
+  {
+	  return level;
+  };
+
+  /// True if the last T_STRING token is only part of the string, more chunks
+  /// follow on the next calls to nextToken() (as more data is fed in).
+  bool isPartial () const
+  {
+	  return partial;
+  };
+
+  /// Extract the last token as string (works for T_STRING and T_NUMBER).
+  /// @param plen This variable will receive the size, if present.
+  /// @return Returns pointer to a string chunk in the fed data (this is
+  ///         NOT zero-terminated), or to the digits of a number.
+  const char* asString (uint32_t* plen =0)
+  {
+	  if (token == T_NUMBER) {
+		  if (plen != 0)
+			  *plen = ndigits;
+		  return digits;
+	  }
+	  if (plen != 0)
+		  *plen = chunkLen;
+	  return chunk;
+  };
+
+  /// Extract the last T_NUMBER token as number.
+  /// @return Returns the decoded integer, max 32-bit signed in this version.
+  long asNumber ()
+  {
+	  return atol(digits);
+  };
+
+  /// Extract the last T_NUMBER token as 64-bit number.
+  /// @param pvalid This variable will receive false on overflow, if present.
+  /// @return Returns the decoded integer, clamped to the 64-bit range.
+  int64_t asInt64 (bool* pvalid =0)
+  {
+	  int64_t val;
+	  bool ok = EmBparseInt64(digits, digits + ndigits, &val);
+	  if (pvalid != 0)
+		  *pvalid = ok;
+	  return val;
+  };
+};
+
+/// Decoder class which calls a handler for each token, without any buffer.
+/// The Handler class must provide these members, which are called directly
+/// (and can be inlined) as the data comes in:
+/// - void onInt(int64_t val)
+/// - void onString(const char* ptr, uint32_t len, bool partial),
+///   where partial is true if more chunks of the same string follow
+/// - void onListBegin()
+/// - void onDictBegin()
+/// - void onEnd(), at the end of each list or dict
+/// Bad data stops all calls until reset(), see lastError(). This includes
+/// numbers outside the 64-bit range, so onInt() never gets a clamped value.
+template <class Handler>
+class EmBdecodeTo : public Handler {
+protected:
+	EmBdecodeStream stream;
+	uint8_t error = EmBdecodeStream::E_NONE; // set here, not by the stream
+
+public:
+	EmBdecodeTo () {}
+  template <class A>
+  EmBdecodeTo (A a) : Handler(a) {}
+  template <class A, class B>
+  EmBdecodeTo (A a, B b) : Handler(a, b) {}
+
+  /// Reset the decoder, to start over at the beginning of a new packet.
+  void reset()
+  {
+	  stream.reset();
+	  error = EmBdecodeStream::E_NONE;
+  }
+
+  /// Process a block of incoming characters, calling the handler as needed.
+  /// @param ptr Pointer to the received data.
+  /// @param len Number of bytes available at ptr.
+  void process(const char* ptr, size_t len)
+  {
+	  if (error != EmBdecodeStream::E_NONE)
+		  return;
+	  stream.feed(ptr, len);
+	  for (;;) {
+		  uint8_t token = stream.nextToken();
+		  switch (token) {
+		  case EmBdecodeStream::T_END:
+		  case EmBdecodeStream::T_ERROR:
+			  return;
+		  case EmBdecodeStream::T_NUMBER: {
+			  bool valid;
+			  int64_t val = stream.asInt64(&valid);
+			  if (!valid) {
+				  error = EmBdecodeStream::E_BAD_NUMBER;
+				  return;
+			  }
+			  this->onInt(val);
+			  break;
+		  }
+		  case EmBdecodeStream::T_DICT:
+			  this->onDictBegin();
+			  break;
+		  case EmBdecodeStream::T_LIST:
+			  this->onListBegin();
+			  break;
+		  case EmBdecodeStream::T_POP:
+			  this->onEnd();
+			  break;
+		  default: { // string
+			  uint32_t len;
+			  const char* p = stream.asString(&len);
+			  this->onString(p, len, stream.isPartial());
+			  break;
+		  }
+		  }
+	  }
+  };
+
+  /// Process a single incoming character, calling the handler as needed.
+  void process(char ch)
+  {
+	  process(&ch, 1);
+  };
+
+  /// Nesting level, a top-level item is complete when this returns zero.
+  int depth () const
+  {
+	  return stream.depth();
+  };
+
+  /// Reason why decoding stopped, see EmBdecodeStream::lastError().
+  uint8_t lastError () const
+  {
+	  return error != EmBdecodeStream::E_NONE ? error : stream.lastError();
+  };
+};
+
+/// Struct serialisation, driven by a field list which is written only once.
+/// For each struct type, supply a function template which lists the fields
+/// as dict keys, in sorted order, for example:
+/// @code
+///   struct Settings { int count; char name[10]; long rate; };
+///
+///   template <class V>
+///   void EmBfields (V& v, Settings& s) {
+///     v("count", s.count);
+///     v("name", s.name);
+///     v("rate", s.rate);
+///   }
+///
+///   EmBschema<Settings>::encode(encoder, settings);
+///   EmBschema<Settings>::decode(settings, ptr, len);
+/// @endcode
+/// Fields can be any integer type or a char array, which holds a string.
+/// Keys are encoded as EmBliteral fragments, each sent with a single write.
+template <class T>
+class EmBschema {
+protected:
+  template <class E>
+  struct Writer {
+    E& enc;
+    Writer (E& e) : enc(e) {}
+
+    // the key goes out as one EmBliteral, its length prefix follows from
+    // the array type, and the optimiser folds the rest for a literal key
+    template <size_t N, typename F>
+    void operator() (const char (&key)[N], F& field) {
+      const EmBliteral<N - 1> lit = EmBlit(key);
+      enc.write(lit.data, lit.len);
+      enc.push(field);
+    }
+  };
+
+  struct Reader {
+    EmBdecodeStream& in;
+    const char* key;
+    uint32_t keyLen;
+    uint8_t token;
+    bool matched, ok;
+    Reader (EmBdecodeStream& s) : in(s), ok(true) {}
+
+    template <size_t N, typename F>
+    void operator() (const char (&name)[N], F& field) {
+      if (!matched && keyLen == N - 1 && memcmp(key, name, N - 1) == 0) {
+        matched = true;
+        Take(field);
+      }
+    }
+
+    template <typename F>
+    void Take (F& field) {
+      bool valid;
+      int64_t val = in.asInt64(&valid);
+      field = (F) val;
+      if (token != EmBdecodeStream::T_NUMBER || !valid || (int64_t) field != val)
+        ok = false;
+    }
+
+    template <size_t N>
+    void Take (char (&field)[N]) {
+      uint32_t len;
+      const char* p = in.asString(&len);
+      if (token != EmBdecodeStream::T_STRING || len > N - 1) {
+        ok = false;
+        len = token == EmBdecodeStream::T_STRING ? N - 1 : 0;
+      }
+      memcpy(field, p, len);
+      field[len] = 0;
+    }
+  };
+
+public:
+  /// Push all the fields of a struct as a dict.
+  /// @param enc The encoder to use, any EmBencode or EmBencodeTo instance.
+  /// @param obj The struct to send out.
+  template <class E>
+  static void encode (E& enc, const T& obj) {
+    Writer<E> w (enc);
+    enc.startDict();
+    EmBfields(w, const_cast<T&>(obj)); // the writer does not change any field
+    enc.endDict();
+  }
+
+  /// Decode a complete dict into a struct, without any token buffer.
+  /// Missing fields are left as is, unknown keys are skipped.
+  /// @param obj The struct which will receive all matching fields.
+  /// @param ptr Pointer to the received data.
+  /// @param len Number of bytes available at ptr.
+  /// @return Returns false if the data is not a complete dict, or if some
+  ///         value does not have the right type or does not fit its field.
+  static bool decode (T& obj, const char* ptr, size_t len) {
+    EmBdecodeStream in;
+    in.feed(ptr, len);
+    if (in.nextToken() != EmBdecodeStream::T_DICT)
+      return false;
+    Reader r (in);
+    for (;;) {
+      uint8_t token = in.nextToken();
+      if (token == EmBdecodeStream::T_POP)
+        return r.ok;
+      if (token != EmBdecodeStream::T_STRING || in.isPartial())
+        return false;
+      r.key = in.asString(&r.keyLen);
+      r.token = in.nextToken();
+      r.matched = false;
+      EmBfields(r, obj);
+      if (r.token == EmBdecodeStream::T_DICT || r.token == EmBdecodeStream::T_LIST)
+        while (in.depth() > 1) {
+          uint8_t t = in.nextToken();
+          if (t == EmBdecodeStream::T_END || t == EmBdecodeStream::T_ERROR)
+            return false;
+        }
+      if (r.token == EmBdecodeStream::T_END || r.token == EmBdecodeStream::T_POP ||
+          r.token == EmBdecodeStream::T_ERROR || in.isPartial())
+        return false;
+    }
+  }
+};
+
+/// One value in a tree built by EmBdom. Lists and dicts refer to an array
+/// of child nodes, dict entries are stored as key, value pairs sorted by key.
+/// Strings and numbers point into the decoder's data, which must stay intact.
+class EmBnode {
+public:
+  /// Types of nodes, with the same codes as the decoder tokens.
+  enum { T_STRING = 0, T_NUMBER = 251, T_DICT, T_LIST };
+
+  uint8_t type;
+  uint32_t len; // size of a string or number, or the number of children
+  union {
+	  const char* str;      // text of a string or number, NOT zero-terminated
+	  const EmBnode* kids;  // children of a list, or key/value pairs of a dict
+  };
+
+  /// Number of items in a list, or of entries in a dict, 0 otherwise.
+  uint32_t size () const
+  {
+	  return type == T_LIST || type == T_DICT ? len : 0;
+  };
+
+  /// Item of a list, in constant time.
+  /// @return Returns 0 if this is not a list, or if there is no such item.
+  const EmBnode* at (uint32_t i) const
+  {
+	  return type == T_LIST && i < len ? kids + i : 0;
+  };
+
+  /// Key of a dict entry, entries are sorted by key.
+  /// @return Returns 0 if this is not a dict, or if there is no such entry.
+  const EmBnode* key (uint32_t i) const
+  {
+	  return type == T_DICT && i < len ? kids + 2 * i : 0;
+  };
+
+  /// Value of a dict entry, i.e. the node right after key(i).
+  const EmBnode* value (uint32_t i) const
+  {
+	  return type == T_DICT && i < len ? kids + 2 * i + 1 : 0;
+  };
+
+  /// Look up a key in a dict, with a binary search.
+  /// @param k The key to look for, n its length.
+  /// @return Returns the value, or 0 if not found or if this is not a dict.
+  const EmBnode* find (const char* k, uint32_t n) const
+  {
+	  if (type != T_DICT)
+		  return 0;
+	  uint32_t lo = 0, hi = len;
+	  while (lo < hi) {
+		  uint32_t mid = lo + (hi - lo) / 2;
+		  int cmp = Compare(kids[2 * mid].str, kids[2 * mid].len, k, n);
+		  if (cmp == 0)
+			  return kids + 2 * mid + 1;
+		  if (cmp < 0)
+			  lo = mid + 1;
+		  else
+			  hi = mid;
+	  }
+	  return 0;
+  };
+
+  /// Look up a zero-terminated key in a dict, see find(k, n).
+  const EmBnode* find (const char* k) const
+  {
+	  return find(k, strlen(k));
+  };
+
+  /// Text of a string or number.
+  /// @param plen This variable will receive the size, if present.
+  /// @return Returns pointer into the decoder's data, NOT zero-terminated.
+  const char* asString (uint32_t* plen =0) const
+  {
+	  bool text = type == T_STRING || type == T_NUMBER;
+	  if (plen != 0)
+		  *plen = text ? len : 0;
+	  return text ? str : 0;
+  };
+
+  /// Value of a number (also works for strings if numeric).
+  /// @param pvalid This variable will receive false on overflow, if present.
+  /// @return Returns the decoded integer, clamped to the 64-bit range.
+  int64_t asInt64 (bool* pvalid =0) const
+  {
+	  int64_t val = 0;
+	  bool ok = asString() != 0 && EmBparseInt64(str, str + len, &val);
+	  if (pvalid != 0)
+		  *pvalid = ok;
+	  return val;
+  };
+
+  /// Order of two keys, as raw byte strings, which is how bencode sorts them.
+  static int Compare (const char* a, uint32_t na, const char* b, uint32_t nb)
+  {
+	  int cmp = memcmp(a, b, na < nb ? na : nb);
+	  return cmp != 0 ? cmp : na < nb ? -1 : na > nb;
+  };
+};
+
+/// Builder which turns decoded tokens into a tree of EmBnode objects, in
+/// one pass and without heap use: all nodes live in a caller-supplied arena.
+/// Works with EmBdecode, EmBdecodeSpan, and EmBbatch after select():
+/// @code
+///   char arena [4000];
+///   EmBdom dom (arena, sizeof arena);
+///   const EmBnode* root = dom.build(decoder);
+///   if (root != 0 && root->find("rate") != 0) ...
+/// @endcode
+/// Dict entries which arrive out of order are sorted, so that find() works.
+class EmBdom {
+protected:
+	EmBnode *base, *fill, *top;
+
+	static int ComparePairs (const void* a, const void* b)
+	{
+		const EmBnode* x = (const EmBnode*) a;
+		const EmBnode* y = (const EmBnode*) b;
+		return EmBnode::Compare(x->str, x->len, y->str, y->len);
+	};
+
+	/// Get the text of the last token, for any decoder's asString() type.
+	template <class D, class C, class L>
+	static const char* Text (D& decoder, const char* (C::*)(L*), uint32_t* plen)
+	{
+		L len;
+		const char* ptr = decoder.asString(&len);
+		*plen = len;
+		return ptr;
+	};
+
+public:
+  /// Initialize a builder with the memory to be used for all nodes.
+  /// @param arena Pointer to the memory, it need not be aligned.
+  /// @param size Size of the arena, each node takes sizeof (EmBnode) bytes.
+  EmBdom (void* arena, size_t size)
+  {
+	  uintptr_t p = (uintptr_t) arena, end = p + size;
+	  p = (p + alignof(EmBnode) - 1) & ~(uintptr_t) (alignof(EmBnode) - 1);
+	  base = (EmBnode*) p;
+	  top = base + (p < end ? (end - p) / sizeof (EmBnode) : 0);
+	  reset();
+  }
+
+  /// Release all nodes, the arena can then be used for a new tree.
+  void reset ()
+  {
+	  fill = base;
+  };
+
+  /// Number of arena bytes in use by the trees built so far.
+  size_t used () const
+  {
+	  return (char*) fill - (char*) base;
+  };
+
+  /// Build a tree from the next value in a decoder, i.e. from the first
+  /// token after process() or parse(), or from the current position.
+  /// Trees of several calls can coexist, until reset() is called.
+  /// @param decoder The decoder to take the tokens from.
+  /// @return Returns the root node, or 0 if the arena is too small or the
+  ///         value is incomplete.
+  template <class D>
+  const EmBnode* build (D& decoder)
+  {
+	  // open nodes are stacked down from the top of the arena, finished child
+	  // arrays are stored up from the bottom, i.e. each node is copied once
+	  EmBnode* sp = top;
+	  EmBnode* open = 0; // innermost open dict or list, links to the outer one
+	  do {
+		  if (sp <= fill)
+			  return 0; // out of memory
+		  EmBnode* node = --sp;
+		  uint8_t token = decoder.nextToken();
+		  switch (token) {
+		  case D::T_STRING:
+		  case D::T_NUMBER:
+			  node->type = token;
+			  node->str = Text(decoder, &D::asString, &node->len);
+			  break;
+		  case D::T_DICT:
+		  case D::T_LIST:
+			  node->type = token;
+			  node->kids = open; // until the matching T_POP arrives
+			  open = node;
+			  break;
+		  case D::T_POP: {
+			  ++sp; // not a node
+			  if (open == 0)
+				  return 0;
+			  uint32_t n = open - sp; // children are below it, in reverse
+			  if (fill + n > sp)
+				  return 0; // out of memory
+			  for (uint32_t i = 0; i < n; ++i)
+				  fill[i] = open[-1 - (int32_t) i];
+			  EmBnode* outer = (EmBnode*) open->kids;
+			  open->kids = fill;
+			  open->len = open->type == EmBnode::T_DICT ? n / 2 : n;
+			  if (open->type == EmBnode::T_DICT) {
+				  if (n % 2 != 0)
+					  return 0; // key without a value
+				  for (uint32_t i = 0; i < n; i += 2)
+					  if (fill[i].type != EmBnode::T_STRING)
+						  return 0; // keys must be strings
+				  for (uint32_t i = 1; i < n / 2; ++i)
+					  if (EmBnode::Compare(fill[2*i-2].str, fill[2*i-2].len,
+								  fill[2*i].str, fill[2*i].len) > 0) {
+						  qsort(fill, n / 2, 2 * sizeof *fill, ComparePairs);
+						  break;
+					  }
+			  }
+			  fill += n;
+			  sp = open;
+			  open = outer;
+			  break;
+		  }
+		  default: // T_END
+			  return 0;
+		  }
+	  } while (open != 0);
+	  // place the root below the child arrays, the stack is now empty
+	  *fill = *sp;
+	  return fill++;
+  };
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,235 @@
+/// @file
+/// Memory-mapped replay and buffered appending of bencoded log files.
+// 2026-10-14 http://opensource.org/licenses/mit-license.php
+
+#pragma once
+#ifndef _EMBLOG_h
+#define _EMBLOG_h
+
+#include "EmBencode.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// Reader for a log file of back-to-back packets, for host-side tools. The
+/// file is mapped into memory, and each packet is parsed in place, so there
+/// are no copies and no allocations per packet:
+/// @code
+///   EmBlogReader<> log;
+///   if (log.open("traffic.log"))
+///     while (log.next())
+///       ... log.nextToken(), log.find("rate"), etc ...
+/// @endcode
+/// The tokens point into the mapping, they stay valid until close().
+/// Anything between packets is skipped, and a packet with more than
+/// maxTokens tokens is stepped over, with oversize() set and no tokens.
+/// A corrupt packet is counted in errorCount(), and replay resyncs one byte
+/// past its start, so a damaged spot does not end the rest of the file.
+/// @param maxTokens The maximum number of tokens in a single packet.
+template <int maxTokens =256>
+class EmBlogReader : public EmBdecodeSpan<maxTokens, uint32_t> {
+	typedef EmBdecodeSpan<maxTokens, uint32_t> Span;
+protected:
+	const char* map;
+	size_t mapLen, pos, start, errors;
+	bool tooLarge;
+
+public:
+	EmBlogReader () : map(0), mapLen(0), pos(0), start(0), errors(0), tooLarge(false) {}
+	~EmBlogReader () { close(); }
+	// the mapping can only be released once
+	EmBlogReader (const EmBlogReader&) = delete;
+	EmBlogReader& operator= (const EmBlogReader&) = delete;
+
+  /// Map a log file, any previous one is closed first.
+  /// @param path Name of the file.
+  /// @return Returns false if the file can't be opened or mapped.
+  bool open (const char* path)
+  {
+	  close();
+	  int fd = ::open(path, O_RDONLY);
+	  if (fd < 0)
+		  return false;
+	  struct stat st;
+	  bool ok = fstat(fd, &st) == 0;
+	  if (ok && st.st_size > 0) {
+		  void* p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		  ok = p != MAP_FAILED;
+		  if (ok) {
+			  madvise(p, st.st_size, MADV_SEQUENTIAL); // replay is one pass
+			  map = (const char*) p;
+			  mapLen = st.st_size;
+		  }
+	  }
+	  ::close(fd); // the mapping stays valid without it
+	  return ok;
+  };
+
+  /// Release the mapping, all tokens become invalid.
+  void close ()
+  {
+	  if (map != 0)
+		  munmap((void*) map, mapLen);
+	  map = 0;
+	  mapLen = pos = start = errors = 0;
+	  tooLarge = false;
+	  Span::reset();
+  };
+
+  /// Parse the next packet, its tokens can then be walked as usual.
+  /// @return Returns false at the end of the file, or if the rest of the
+  ///         file is not a complete packet. Corrupt packets are skipped.
+  bool next ()
+  {
+	  Span::reset();
+	  while (pos < mapLen) {
+		  char ch = map[pos];
+		  if (ch != 'i' && ch != 'd' && ch != 'l' && (ch < '0' || ch > '9')) {
+			  ++pos; // ignore anything else between packets
+			  continue;
+		  }
+		  bool valid;
+		  size_t n = EmBskim(map + pos, mapLen - pos, &valid);
+		  if (n == 0 && valid)
+			  break; // incomplete, the rest of the file is a partial packet
+		  if (n == 0) {
+			  ++errors;
+			  ++pos; // bad data, resync on the next plausible start
+			  continue;
+		  }
+		  start = pos;
+		  pos += n;
+		  // the 32-bit token fields also limit the size of each packet
+		  tooLarge = n > 0xFFFFFFFFUL || this->parse(map + start, n) != n;
+		  return true;
+	  }
+	  start = pos;
+	  tooLarge = false;
+	  return false;
+  };
+
+  /// Go back to the start of the file, to replay it again.
+  void restart ()
+  {
+	  pos = start = errors = 0;
+	  tooLarge = false;
+	  Span::reset();
+  };
+
+  /// True if the current packet was stepped over without any tokens, as it
+  /// has more than maxTokens, see offset() and length() to get at its data.
+  bool oversize () const
+  {
+	  return tooLarge;
+  };
+
+  /// Number of corrupt spots skipped since open() or restart().
+  size_t errorCount () const
+  {
+	  return errors;
+  };
+
+  /// Offset in the file where the current packet starts. After next()
+  /// returned false, this is where parsing stopped, i.e. size() if all of
+  /// the file was used.
+  size_t offset () const
+  {
+	  return start;
+  };
+
+  /// Number of bytes in the current packet.
+  size_t length () const
+  {
+	  return pos - start;
+  };
+
+  /// Pointer to the start of the mapped file.
+  const char* data () const
+  {
+	  return map;
+  };
+
+  /// Size of the mapped file.
+  size_t size () const
+  {
+	  return mapLen;
+  };
+};
+
+/// Output sink which appends to a log file, via a large write-combining
+/// buffer, so that many small frames result in few system calls:
+/// @code
+///   EmBencodeTo<EmBlogSink> log ("traffic.log");
+///   log.startDict(); ... log.endDict();
+///   log.flush(); // also done when the encoder is destroyed
+/// @endcode
+/// Runs which are larger than the buffer are written out directly.
+class EmBlogSink {
+protected:
+  int fd;
+  char* buffer;
+  size_t limit, fill;
+  bool error;
+
+  void Put (const char* ptr, size_t len) {
+    while (len > 0 && !error) {
+      ssize_t n = ::write(fd, ptr, len);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        error = true;
+      else {
+        ptr += n;
+        len -= n;
+      }
+    }
+  }
+
+public:
+  /// @param path Name of the file, it is created if needed.
+  /// @param bufSize Size of the write-combining buffer.
+  EmBlogSink (const char* path, size_t bufSize =1 << 20)
+    : fd(::open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)),
+      buffer((char*) malloc(bufSize)), limit(bufSize), fill(0),
+      error(fd < 0 || buffer == 0) {}
+
+  ~EmBlogSink () {
+    flush();
+    if (fd >= 0)
+      ::close(fd);
+    free(buffer);
+  }
+
+  // the file and buffer can only be released once
+  EmBlogSink (const EmBlogSink&) = delete;
+  EmBlogSink& operator= (const EmBlogSink&) = delete;
+
+  /// Append a run of bytes, usually only to the buffer.
+  void write (const void* ptr, size_t len) {
+    if (len > limit - fill) {
+      flush();
+      if (len >= limit) {
+        Put((const char*) ptr, len);
+        return;
+      }
+    }
+    if (!error) {
+      memcpy(buffer + fill, ptr, len);
+      fill += len;
+    }
+  }
+
+  /// Write out everything which is still in the buffer.
+  void flush () {
+    Put(buffer, fill);
+    fill = 0;
+  }
+
+  /// True once the file could not be opened, or a write has failed.
+  bool failed () const { return error; }
+};
+
+#endif
@@ -0,0 +1,279 @@
+/// @file
+/// Lock-free byte ring, to pass received data from an interrupt to a decoder,
+/// and a queue of decoded packets, to hand them on to the main loop.
+// 2026-10-14 http://opensource.org/licenses/mit-license.php
+
+#pragma once
+#ifndef _EMBRING_h
+#define _EMBRING_h
+
+#include <stdint.h>
+#include <stddef.h>
+#if defined(__AVR__)
+#include <util/atomic.h>
+#else
+#include <atomic>
+#endif
+
+/// Single-producer / single-consumer byte ring. The producer, typically the
+/// UART receive interrupt, calls put() for each byte. The consumer, typically
+/// loop(), passes whole runs of bytes to a decoder with process():
+/// @code
+///   EmBring<64> ring;
+///   EmBdecode<100> decoder;
+///
+///   ISR(USART_RX_vect) { ring.put(UDR0); }
+///
+///   void loop () {
+///     if (ring.process(decoder) > 0) {
+///       ... decoder.nextToken(), etc ...
+///       decoder.reset();
+///     }
+///   }
+/// @endcode
+/// The ring holds up to ringLen - 1 bytes. On AVR, index updates are
+/// interrupt-safe through atomic blocks (if SizeT is wider than a byte),
+/// elsewhere C++11 atomics with acquire/release ordering are used.
+template <int ringLen, typename SizeT =uint8_t>
+class EmBring {
+	static_assert(ringLen >= 2 && (ringLen & (ringLen - 1)) == 0,
+			"ringLen must be a power of 2");
+	static_assert(ringLen - 1 <= (SizeT) ~(SizeT) 0, "SizeT too small for ringLen");
+	enum { MASK = ringLen - 1 };
+protected:
+	char data[ringLen];
+	uint16_t drops; // written by the producer only
+#if defined(__AVR__)
+	volatile SizeT head, tail;
+
+	static SizeT Own (const volatile SizeT& v)
+	{
+		return v; // only the owning side writes this index
+	};
+
+	static SizeT Acquire (const volatile SizeT& v)
+	{
+		SizeT x;
+		if (sizeof x == 1)
+			x = v;
+		else
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { x = v; }
+		__asm__ __volatile__ ("" ::: "memory"); // no data reads before this
+		return x;
+	};
+
+	static void Release (volatile SizeT& v, SizeT x)
+	{
+		__asm__ __volatile__ ("" ::: "memory"); // all data writes before this
+		if (sizeof x == 1)
+			v = x;
+		else
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { v = x; }
+	};
+#else
+	std::atomic<SizeT> head, tail;
+
+	static SizeT Own (const std::atomic<SizeT>& v)
+	{
+		return v.load(std::memory_order_relaxed);
+	};
+
+	static SizeT Acquire (const std::atomic<SizeT>& v)
+	{
+		return v.load(std::memory_order_acquire);
+	};
+
+	static void Release (std::atomic<SizeT>& v, SizeT x)
+	{
+		v.store(x, std::memory_order_release);
+	};
+#endif
+
+public:
+	EmBring () : drops(0), head(0), tail(0) {}
+
+  /// Producer side: add one byte, e.g. from a receive interrupt.
+  /// @return Returns false if the ring is full, the byte is then dropped.
+  bool put (char ch)
+  {
+	  SizeT h = Own(head);
+	  SizeT n = (h + 1) & MASK;
+	  if (n == Acquire(tail)) {
+		  if (drops < 0xFFFF)
+			  ++drops;
+		  return false;
+	  }
+	  data[h] = ch;
+	  Release(head, n);
+	  return true;
+  };
+
+  /// Number of bytes dropped by put() because the ring was full.
+  uint16_t dropCount () const
+  {
+	  return drops;
+  };
+
+  /// Consumer side: get the longest contiguous run of buffered bytes.
+  /// @param pptr This variable will receive a pointer to the first byte.
+  /// @return Returns the number of bytes available at the pointer, which can
+  ///         be less than the total if the data wraps around.
+  size_t peek (const char** pptr)
+  {
+	  SizeT h = Acquire(head), t = Own(tail);
+	  *pptr = data + t;
+	  return h >= t ? h - t : ringLen - t;
+  };
+
+  /// Consumer side: release bytes which have been used, after peek().
+  /// @param len Number of bytes, must not exceed what peek() returned.
+  void consume (size_t len)
+  {
+	  Release(tail, (Own(tail) + len) & MASK);
+  };
+
+  /// Consumer side: feed buffered bytes to a decoder with a bulk process()
+  /// call, i.e. EmBdecode, until a packet is complete or the ring is empty.
+  /// @param decoder The decoder which will receive the data.
+  /// @return Returns a count > 0 when the decoder contains a complete packet.
+  template <class D>
+  size_t process (D& decoder)
+  {
+	  const char* ptr;
+	  size_t len;
+	  while ((len = peek(&ptr)) > 0) {
+		  size_t used;
+		  size_t result = decoder.process(ptr, len, &used);
+		  consume(used);
+		  if (result > 0)
+			  return result;
+	  }
+	  return 0;
+  };
+};
+
+/// Queue of decoded packets, so that the receiver can run ahead while the
+/// application handles earlier packets, e.g. process() from an interrupt
+/// and front() / pop() in the main loop. Each slot is a complete decoder,
+/// i.e. there is one token buffer per packet which can be queued up:
+/// @code
+///   EmBdecodeQueue<EmBdecode<100>, 4> queue;
+///   ...
+///   while (queue.available()) {
+///     EmBdecode<100>& packet = *queue.front();
+///     ... packet.nextToken(), etc ...
+///     queue.pop();
+///   }
+/// @endcode
+/// One context may call process(), and one other context front() and pop().
+/// As in EmBring, the counts are handed over with acquire/release ordering,
+/// so that a slot is only reused once the reset in pop() is complete.
+template <class Decoder, int numSlots =2>
+class EmBdecodeQueue {
+	static_assert(0 < numSlots && numSlots <= 128 &&
+			(numSlots & (numSlots - 1)) == 0, "numSlots must be a power of 2");
+protected:
+	Decoder slots[numSlots];
+	// free-running counts of packets in and out, each has a single writer
+#if defined(__AVR__)
+	volatile uint8_t head, tail;
+
+	static uint8_t Own (const volatile uint8_t& v)
+	{
+		return v;
+	};
+
+	static uint8_t Acquire (const volatile uint8_t& v)
+	{
+		uint8_t x = v; // a single byte needs no atomic block
+		__asm__ __volatile__ ("" ::: "memory"); // no slot reads before this
+		return x;
+	};
+
+	static void Release (volatile uint8_t& v, uint8_t x)
+	{
+		__asm__ __volatile__ ("" ::: "memory"); // all slot writes before this
+		v = x;
+	};
+#else
+	std::atomic<uint8_t> head, tail;
+
+	static uint8_t Own (const std::atomic<uint8_t>& v)
+	{
+		return v.load(std::memory_order_relaxed);
+	};
+
+	static uint8_t Acquire (const std::atomic<uint8_t>& v)
+	{
+		return v.load(std::memory_order_acquire);
+	};
+
+	static void Release (std::atomic<uint8_t>& v, uint8_t x)
+	{
+		v.store(x, std::memory_order_release);
+	};
+#endif
+
+public:
+	EmBdecodeQueue () : head(0), tail(0) {}
+
+  /// Process a block of incoming characters, queueing all complete packets.
+  /// @param ptr Pointer to the received data.
+  /// @param len Number of bytes available at ptr.
+  /// @return Returns the number of bytes consumed, less than len only when
+  ///         the queue is full and more packets need to be popped first.
+  size_t process(const char* ptr, size_t len)
+  {
+	  size_t done = 0;
+	  uint8_t h = Own(head);
+	  while (done < len && (uint8_t) (h - Acquire(tail)) < numSlots) {
+		  size_t used;
+		  if (slots[h % numSlots].process(ptr + done, len - done, &used) > 0)
+			  Release(head, ++h);
+		  done += used;
+	  }
+	  return done;
+  };
+
+  /// Process a single incoming character.
+  /// @return Returns false if the queue is full, the character was not used.
+  bool process(char ch)
+  {
+	  return process(&ch, 1) > 0;
+  };
+
+  /// Number of complete packets waiting in the queue.
+  uint8_t available () const
+  {
+	  return Acquire(head) - Acquire(tail);
+  };
+
+  /// Get the oldest complete packet, to extract its tokens.
+  /// @return Returns a pointer to the decoder holding it, or 0 if none.
+  Decoder* front ()
+  {
+	  uint8_t t = Own(tail);
+	  return Acquire(head) != t ? &slots[t % numSlots] : 0;
+  };
+
+  /// Release the oldest packet, after its tokens have been used.
+  void pop ()
+  {
+	  uint8_t t = Own(tail);
+	  if (Acquire(head) != t) {
+		  slots[t % numSlots].reset();
+		  Release(tail, t + 1);
+	  }
+  };
+
+  /// Total number of bad packets dropped, see EmBdecode::errorCount().
+  uint16_t errorCount () const
+  {
+	  uint16_t total = 0;
+	  for (int i = 0; i < numSlots; ++i)
+		  total += slots[i].errorCount();
+	  return total;
+  };
+};
+
+#endif
@@ -0,0 +1,67 @@
+/// @dir benchmark
+/// Measure encoder and decoder speed on the target, reports cycles per byte.
+// 2026-10-14 http://opensource.org/licenses/mit-license.php
+
+// The results are printed on the serial port. To get cycle counts without
+// hardware, the compiled .elf can also be run in a simulator such as simavr,
+// i.e. "simavr -m atmega328p -f 16000000 benchmark.ino.elf".
+// See extras/bench for the host-side version with larger test corpora.
+
+#include "EmBencode.h"
+
+#define RUNS 100
+
+EmBencode<100> encoder;
+EmBdecode<200> decoder;
+
+static void encodeSample () {
+  encoder.reset();
+  encoder.startDict();
+    encoder.push("count");
+    encoder.push(10);
+    encoder.push("rate");
+    encoder.push(250);
+    encoder.push("time");
+    encoder.push(123456789L);
+    encoder.push("name");
+    encoder.push("blinky");
+  encoder.endDict();
+}
+
+static void report (const char* what, unsigned long us, int bytes) {
+  Serial.print(what);
+  Serial.print(us / RUNS);
+  Serial.print(" us, ");
+  // cycles per byte, computed in two steps to avoid overflow
+  Serial.print((us * (F_CPU / 1000000L)) / ((long) RUNS * bytes));
+  Serial.println(" cycles/byte");
+}
+
+void setup () {
+  Serial.begin(57600);
+  Serial.println("\n[benchmark]");
+
+  unsigned long start = micros();
+  for (int i = 0; i < RUNS; ++i)
+    encodeSample();
+  unsigned long us = micros() - start;
+  int len = encoder.size();
+  Serial.print(len);
+  Serial.println(" bytes per message");
+  report("encode: ", us, len);
+
+  start = micros();
+  for (int i = 0; i < RUNS; ++i)
+    for (int k = 0; k < len; ++k)
+      if (decoder.process(encoder.data()[k]))
+        decoder.reset();
+  report("decode per-byte: ", micros() - start, len);
+
+  start = micros();
+  for (int i = 0; i < RUNS; ++i)
+    if (decoder.process((const char*) encoder.data(), len))
+      decoder.reset();
+  report("decode bulk: ", micros() - start, len);
+}
+
+void loop () {}
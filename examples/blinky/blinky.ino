@@ -11,9 +11,15 @@
 #define VERSION 100
 #define LED 9
 
+struct SerialSink {
+  void write (const void* ptr, size_t len) {
+    Serial.write((const uint8_t*) ptr, len);
+  }
+};
+
 char embuf [200];
-EmBdecode decoder (embuf, sizeof embuf);
-EmBencode encoder;
+EmBdecodeBuffer<> decoder (embuf, sizeof embuf);
+EmBencodeTo<SerialSink> encoder;
 
 int rate;       // time between toggling the LED (ms)
 int count;      // number of blinks still to go
@@ -21,18 +27,14 @@ int trigger;    // after how many blinks to trigger
 long total;     // total number of blinks
 long lastFlip;  // time when we last flipped the LED (ms)
 
-void EmBencode::PushChar (char ch) {
-  Serial.write(ch);
-}
-
 static void sendGreeting () {
   encoder.startList();
-  encoder.push("blinky");
+  EMB_PUSH_LITERAL(encoder, "blinky");
   encoder.push(VERSION);
   encoder.endList();
 }
 
-static void sendErrorMsg (const char* msg) {
+static void sendErrorMsg (const __FlashStringHelper* msg) {
   encoder.startList();
   encoder.push(1); // error code
   encoder.push(msg);
@@ -41,22 +43,22 @@ static void sendErrorMsg (const char* msg) {
 
 static void sendDoneMsg () {
   encoder.startList();
-  encoder.push("done");
+  EMB_PUSH_LITERAL(encoder, "done");
   encoder.endList();
 }
 
 void sendTriggerTime () {
   encoder.startList();
-  encoder.push("time");
+  EMB_PUSH_LITERAL(encoder, "time");
   encoder.push(millis());
   encoder.endList();
 }
 
 static void setNumber (int& ivar) {
-  if (decoder.nextToken() == EmBdecode::T_NUMBER)
+  if (decoder.nextToken() == EmBdecodeBuffer<>::T_NUMBER)
     ivar = decoder.asNumber();
   else
-    sendErrorMsg("number expected");
+    sendErrorMsg(F("number expected"));
 }
 
 void setup () {
@@ -71,8 +73,8 @@ void loop () {
   // process incoming serial data
   if (Serial.available() > 0 &&
       decoder.process(Serial.read()) > 0 &&
-      decoder.nextToken() == EmBdecode::T_LIST &&
-      decoder.nextToken() == EmBdecode::T_STRING) {
+      decoder.nextToken() == EmBdecodeBuffer<>::T_LIST &&
+      decoder.nextToken() == EmBdecodeBuffer<>::T_STRING) {
     // a complete message has been received
     const char* cmd = decoder.asString();
     if (strcmp(cmd, "rate") == 0)
@@ -82,7 +84,7 @@ void loop () {
     else if (strcmp(cmd, "trigger") == 0)
       setNumber(trigger);
     else
-      sendErrorMsg("command expected");
+      sendErrorMsg(F("command expected"));
     decoder.reset();
     total = 0; // synchronise on each new setting
   }
@@ -8,7 +8,7 @@
 #include "EmBencode.h"
 
 char embuf [200];
-EmBdecode decoder (embuf, sizeof embuf);
+EmBdecodeBuffer<> decoder (embuf, sizeof embuf);
 
 void setup () {
   Serial.begin(57600);
@@ -26,24 +26,24 @@ void loop () {
       Serial.println(" bytes");
       for (;;) {
         uint8_t token = decoder.nextToken();
-        if (token == EmBdecode::T_END)
+        if (token == EmBdecodeBuffer<>::T_END)
           break;
         switch (token) {
-          case EmBdecode::T_STRING:
+          case EmBdecodeBuffer<>::T_STRING:
             Serial.print(" string: ");
             Serial.println(decoder.asString());
             break;
-          case EmBdecode::T_NUMBER:
+          case EmBdecodeBuffer<>::T_NUMBER:
             Serial.print(" number: ");
             Serial.println(decoder.asNumber());
             break;
-          case EmBdecode::T_DICT:
+          case EmBdecodeBuffer<>::T_DICT:
             Serial.println(" > dict");
             break;
-          case EmBdecode::T_LIST:
+          case EmBdecodeBuffer<>::T_LIST:
             Serial.println(" > list");
             break;
-          case EmBdecode::T_POP:
+          case EmBdecodeBuffer<>::T_POP:
             Serial.println(" < pop");
             break;
         }
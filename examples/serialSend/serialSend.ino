@@ -4,12 +4,14 @@
 
 #include "EmBencode.h"
 
-void EmBencode::PushChar (char ch) {
-  Serial.write(ch);
-}
+struct SerialSink {
+  void write (const void* ptr, size_t len) {
+    Serial.write((const uint8_t*) ptr, len);
+  }
+};
 
 static void sendSomeData () {
-  EmBencode encoder;
+  EmBencodeTo<SerialSink> encoder;
   // send a simple string
   encoder.push("abcde");
   // send a number of bytes, could be binary
@@ -0,0 +1,244 @@
+/// @dir bench
+/// Host-side throughput benchmark for the encoder and decoders.
+// 2026-10-14 http://opensource.org/licenses/mit-license.php
+
+// Build and run from the library folder, for example:
+//  g++ -O2 -std=c++11 -I. extras/bench/bench.cpp -o bench && ./bench
+//
+// Each corpus is encoded into memory once, then all variants are timed
+// over it repeatedly. See examples/benchmark for the on-device version.
+
+#include "EmBencode.h"
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+/// Sink which appends to a std::string, used to build the corpora.
+class StringSink {
+public:
+  std::string out;
+
+  void write (const void* ptr, size_t len) {
+    out.append((const char*) ptr, len);
+  }
+};
+
+typedef EmBdecode<16384, uint16_t, 32> Decoder; // the nesting corpus is 30 deep
+typedef EmBdecodeSpan<2048, uint16_t> SpanDecoder;
+
+/// One set of representative messages, generated by a function which can
+/// run against any encoder type, so that encoding can be timed as well.
+struct Corpus {
+  const char* name;
+  void (*generate)(EmBencodeTo<StringSink>*, EmBencodeTo<EmMemorySink>*);
+  std::string data;
+  size_t packets, tokens, peakDecode, peakEncode;
+};
+
+template <class E>
+static void commands (E& enc) {
+  static const char* names[] = { "rate", "count", "trigger" };
+  for (int i = 0; i < 300; ++i) {
+    enc.startList();
+    enc.push(names[i % 3]);
+    enc.push(i * 7 % 1000);
+    enc.endList();
+  }
+}
+
+template <class E>
+static void telemetry (E& enc) {
+  static const char* keys[] = {
+    "bat", "cnt", "hum", "lux", "pre", "rss", "seq", "tmp", "ts", "up",
+  };
+  for (int i = 0; i < 100; ++i) {
+    enc.startDict();
+    for (int k = 0; k < 10; ++k) {
+      enc.push(keys[k]);
+      enc.push((long long) i * 1000003LL * (k + 1) - 500000);
+    }
+    enc.endDict();
+  }
+}
+
+template <class E>
+static void strings (E& enc) {
+  static char blob[1000];
+  for (size_t i = 0; i < sizeof blob; ++i)
+    blob[i] = 'a' + i % 26;
+  for (int i = 0; i < 20; ++i) {
+    enc.startList();
+    for (int k = 0; k < 4; ++k)
+      enc.push(blob, sizeof blob - k * 100);
+    enc.endList();
+  }
+}
+
+template <class E>
+static void nesting (E& enc) {
+  for (int i = 0; i < 50; ++i) {
+    for (int k = 0; k < 30; ++k)
+      k & 1 ? enc.startList() : (enc.startDict(), enc.push("x"));
+    enc.push(i);
+    for (int k = 30; --k >= 0; )
+      k & 1 ? enc.endList() : enc.endDict();
+  }
+}
+
+#define CORPUS(f) \
+  static void gen_##f (EmBencodeTo<StringSink>* s, EmBencodeTo<EmMemorySink>* m) \
+  { if (s) f(*s); else f(*m); }
+CORPUS(commands)
+CORPUS(telemetry)
+CORPUS(strings)
+CORPUS(nesting)
+
+/// Time a function, repeating it until at least 200 ms have passed.
+/// @return Returns the average time per call in nanoseconds.
+template <class F>
+static double timeit (F fn) {
+  Clock::time_point start = Clock::now();
+  long runs = 0;
+  double elapsed;
+  do {
+    fn();
+    ++runs;
+    elapsed = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+  } while (elapsed < 2e8);
+  return elapsed / runs;
+}
+
+static void report (const char* what, const Corpus& c, double ns) {
+  printf("  %-16s %9.1f MB/s %8.2f ns/token\n",
+          what, c.data.size() / ns * 1e3, ns / c.tokens);
+}
+
+/// Stop if a timed variant did not get through the whole corpus, since its
+/// timing would then be meaningless.
+static void check (const char* what, const Corpus& c, size_t packets) {
+  if (packets != c.packets) {
+    fprintf(stderr, "%s %s: got %zu of %zu packets\n",
+            c.name, what, packets, c.packets);
+    exit(1);
+  }
+}
+
+static volatile size_t sink; // keeps results alive
+
+static void run (Corpus& c) {
+  EmBencodeTo<StringSink> enc;
+  c.generate(&enc, 0);
+  c.data = enc.out;
+  const char* data = c.data.data();
+  size_t len = c.data.size();
+
+  // walk the corpus once to collect the statistics
+  Decoder* dec = new Decoder;
+  c.packets = c.tokens = c.peakDecode = c.peakEncode = 0;
+  size_t start = 0;
+  for (size_t pos = 0; pos < len; ) {
+    size_t used;
+    size_t bytes = dec->process(data + pos, len - pos, &used);
+    pos += used;
+    if (bytes > 0) {
+      ++c.packets;
+      if (bytes > c.peakDecode)
+        c.peakDecode = bytes;
+      if (pos - start > c.peakEncode)
+        c.peakEncode = pos - start;
+      start = pos;
+      while (dec->nextToken() != Decoder::T_END)
+        ++c.tokens;
+      dec->reset();
+    }
+  }
+
+  printf("%s: %zu bytes, %zu packets, %zu tokens\n",
+          c.name, len, c.packets, c.tokens);
+  printf("  peak packet %zu bytes, peak decode buffer %zu bytes\n",
+          c.peakEncode, c.peakDecode);
+
+  std::vector<char> out (len);
+  size_t got; // packets seen by the last run of each variant
+  report("encode", c, timeit([&] {
+    EmBencodeTo<EmMemorySink> mem (out.data(), out.size());
+    c.generate(0, &mem);
+    sink = mem.size();
+    got = mem.size() == len && memcmp(out.data(), data, len) == 0 ? c.packets : 0;
+  }));
+  check("encode", c, got);
+
+  report("decode per-byte", c, timeit([&] {
+    got = 0;
+    for (size_t pos = 0; pos < len; ++pos)
+      if (dec->process(data[pos]) > 0) {
+        sink = dec->nextToken();
+        dec->reset();
+        ++got;
+      }
+  }));
+  check("decode per-byte", c, got);
+
+  report("decode bulk", c, timeit([&] {
+    got = 0;
+    for (size_t pos = 0; pos < len; ) {
+      size_t used;
+      if (dec->process(data + pos, len - pos, &used) > 0) {
+        sink = dec->nextToken();
+        dec->reset();
+        ++got;
+      }
+      pos += used;
+    }
+  }));
+  check("decode bulk", c, got);
+
+  SpanDecoder* span = new SpanDecoder;
+  report("decode span", c, timeit([&] {
+    got = 0;
+    for (size_t pos = 0; pos < len; ) {
+      size_t used = span->parse(data + pos, len - pos);
+      if (used == 0)
+        break;
+      sink = span->nextToken();
+      pos += used;
+      ++got;
+    }
+  }));
+  check("decode span", c, got);
+
+  report("walk tokens", c, timeit([&] {
+    got = 0;
+    for (size_t pos = 0; pos < len; ) {
+      size_t used;
+      if (dec->process(data + pos, len - pos, &used) > 0) {
+        while (dec->nextToken() != Decoder::T_END)
+          sink = dec->asString()[0];
+        dec->reset();
+        ++got;
+      }
+      pos += used;
+    }
+  }));
+  check("walk tokens", c, got);
+
+  delete span;
+  delete dec;
+}
+
+int main () {
+  Corpus corpora[] = {
+    { "commands", gen_commands, "", 0, 0, 0, 0 },
+    { "telemetry", gen_telemetry, "", 0, 0, 0, 0 },
+    { "strings", gen_strings, "", 0, 0, 0, 0 },
+    { "nesting", gen_nesting, "", 0, 0, 0, 0 },
+  };
+  for (size_t i = 0; i < sizeof corpora / sizeof *corpora; ++i)
+    run(corpora[i]);
+  return 0;
+}